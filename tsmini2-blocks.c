@@ -0,0 +1,154 @@
+/* Helpers for tsmini2-blocks.h: CRC32C, using the SSE4.2 or ARMv8 CRC32
+ * instructions when the CPU has them and a table otherwise, and the delta
+ * coding of TSMINI2_BLK_PACKED payloads.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "tsmini2-blocks.h"
+
+static uint32_t table[256];
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t *p, size_t len) {
+	while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len) {
+	uint64_t c = crc, v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	for (; len; len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return c;
+}
+
+static int have_hw(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len) {
+	uint64_t v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = __crc32cb(crc, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	for (; len; len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+
+static int have_hw(void) {
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#else
+#define crc_hw crc_sw
+static int have_hw(void) {
+	return 0;
+}
+#endif
+
+static uint32_t crc_init(uint32_t crc, const uint8_t *p, size_t len);
+static uint32_t (*crc_fn)(uint32_t, const uint8_t *, size_t) = crc_init;
+
+/* First call picks the implementation; racing callers all pick the same */
+static uint32_t crc_init(uint32_t crc, const uint8_t *p, size_t len) {
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		table[i] = c;
+	}
+	crc_fn = have_hw() ? crc_hw : crc_sw;
+	return crc_fn(crc, p, len);
+}
+
+uint32_t tsmini2_crc32c(uint32_t crc, const void *buf, size_t len) {
+	return ~crc_fn(~crc, buf, len);
+}
+
+/* prev[] size; the card has 4 */
+#define MAX_CHANNELS 16
+
+size_t tsmini2_pack(void *out, size_t max, const void *in, size_t len,
+  unsigned channels) {
+	uint16_t prev[MAX_CHANNELS] = { 0 }, v, z;
+	const uint8_t *p = in;
+	uint8_t *o = out, *end = o + max;
+	unsigned c = 0;
+	size_t i;
+
+	if (channels == 0 || channels > MAX_CHANNELS) return 0;
+	for (i = 0; i + 2 <= len; i += 2) {
+		memcpy(&v, p + i, 2);
+		v = le16toh(v);
+		z = (uint16_t)(v - prev[c]);
+		z = z << 1 ^ -(z >> 15);
+		prev[c] = v;
+		if (++c == channels) c = 0;
+		if (end - o < 3) return 0;
+		if (z < 0x80) {
+			*o++ = z;
+		} else if (z < 0x4000) {
+			*o++ = 0x80 | z >> 8;
+			*o++ = z;
+		} else {
+			*o++ = 0xc0;
+			*o++ = z >> 8;
+			*o++ = z;
+		}
+	}
+	return o - (uint8_t *)out;
+}
+
+size_t tsmini2_unpack(void *out, size_t max, const void *in, size_t len,
+  unsigned channels) {
+	uint16_t prev[MAX_CHANNELS] = { 0 }, v, z;
+	const uint8_t *p = in, *end = p + len;
+	uint8_t *o = out;
+	unsigned c = 0;
+
+	if (channels == 0 || channels > MAX_CHANNELS) return 0;
+	while (p < end) {
+		if (*p < 0x80) {
+			z = *p++;
+		} else if (*p < 0xc0) {
+			if (end - p < 2) return 0;
+			z = (p[0] & 0x3f) << 8 | p[1];
+			p += 2;
+		} else {
+			if (end - p < 3 || p[0] != 0xc0) return 0;
+			z = p[1] << 8 | p[2];
+			p += 3;
+		}
+		if (max - (o - (uint8_t *)out) < 2) return 0;
+		v = prev[c] + (uint16_t)(z >> 1 ^ -(z & 1));
+		prev[c] = v;
+		if (++c == channels) c = 0;
+		v = htole16(v);
+		memcpy(o, &v, 2);
+		o += 2;
+	}
+	return c ? 0 : o - (uint8_t *)out;
+}
@@ -0,0 +1,67 @@
+/* The "tsmini2 --blocks" stream: the raw samples cut into blocks, each with
+ * a header saying where it belongs and a checksum of what it carries, so a
+ * consumer can spot lost, repeated or damaged blocks and time-align them
+ * without any side channel.  tsmini2-unblock turns it back into raw samples.
+ *
+ * All header fields are little endian, like the samples.  A block is
+ * hdr_len bytes of header followed by len bytes of samples.  seq counts
+ * blocks from 0; a jump in sample with seq in step means tsmini2 itself lost
+ * samples there (the FIFO filled, or the card's FIFO overflowed), a jump in
+ * seq means blocks went missing downstream.  The timestamps are estimates
+ * for the first sample of the block, from when the DMA poll found it.
+ *
+ * Under --channels or --shed the payload may be reduced, and flags say
+ * how: the channels kept (channels is then how many), how many input
+ * samples each output sample averages, and whether it is delta coded
+ * (tsmini2_unpack()).  sample still counts input samples, so the next
+ * block's is this one's plus its output samples times TSMINI2_BLK_DECIM().
+ */
+#ifndef TSMINI2_BLOCKS_H
+#define TSMINI2_BLOCKS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TSMINI2_BLK_MAGIC 0x424d5354 /* "TSMB" */
+#define TSMINI2_BLK_VERSION 1
+
+struct tsmini2_blk {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t hdr_len;     /* sizeof(struct tsmini2_blk) for version 1 */
+	uint64_t seq;
+	uint64_t sample;      /* Absolute index of the first sample */
+	uint64_t realtime_ns; /* CLOCK_REALTIME of the first sample */
+	uint64_t mono_ns;     /* CLOCK_MONOTONIC of the first sample */
+	uint32_t len;         /* Payload bytes */
+	uint16_t channels;    /* Interleaved per sample */
+	uint16_t bits;        /* Per channel, signed */
+	uint32_t config;      /* REG_CFG: coupling, FIR bank, FPGA rev */
+	uint32_t flags;       /* TSMINI2_BLK_* */
+	uint32_t crc;         /* CRC32C of the payload */
+	uint32_t hdr_crc;     /* CRC32C of the header up to here */
+};
+
+#define TSMINI2_BLK_CHANS(f) ((f) & 0xf) /* Channel mask, 0 is all four */
+#define TSMINI2_BLK_DECIM(f) ((f) >> 8 & 0xff ? (f) >> 8 & 0xff : 1)
+#define TSMINI2_BLK_PACKED (1 << 16)      /* Delta coded */
+#define TSMINI2_BLK_STAGE(f) ((f) >> 24 & 0x7f) /* --shed stage, 0 is none */
+#define TSMINI2_BLK_RESTAGED (1U << 31)   /* First block of a new stage */
+
+/* CRC32C (Castagnoli), continuing from crc; start with 0.  Uses the CPU's
+ * CRC32 instructions where there are any.
+ */
+uint32_t tsmini2_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Lossless delta coding of 16-bit samples with channels interleaved: each
+ * value becomes its zigzagged difference from the previous one of its
+ * channel in 1, 2 or 3 bytes.  tsmini2_pack() returns the packed length, 0
+ * if it would not fit in max; tsmini2_unpack() the unpacked length, 0 if in
+ * is damaged or would not fit.
+ */
+size_t tsmini2_pack(void *out, size_t max, const void *in, size_t len,
+  unsigned channels);
+size_t tsmini2_unpack(void *out, size_t max, const void *in, size_t len,
+  unsigned channels);
+
+#endif
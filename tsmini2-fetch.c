@@ -0,0 +1,165 @@
+/* Client for "tsmini2 --listen=PORT --framed": writes the raw sample stream
+ * to stdout and, if the connection drops, reconnects and carries on from
+ * the last sample it wrote.  tsmini2 keeps everything not yet acknowledged
+ * in its FIFO, so a drop costs nothing unless the FIFO overflowed meanwhile,
+ * in which case the gap is reported on stderr, as are samples tsmini2 threw
+ * away under --overflow=drop-*.
+ *
+ * Example usage:
+ *   ./tsmini2-fetch 192.168.1.30:1234 > samples.out
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Must match tsmini2.c */
+#define FRAME_MAGIC 0x54534d46
+enum { FRAME_START = 1, FRAME_DATA, FRAME_END, FRAME_ACK, FRAME_GAP };
+#define SAMPLE_BYTES 8
+
+struct frame {
+	uint32_t magic, type;
+	uint64_t sample, len;
+};
+
+#define CREDIT (16 << 20) /* Bytes tsmini2 may send ahead of our ACK */
+#define BUFLEN (1 << 20)
+
+static int dial(const char *host, const char *port) {
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, e;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	e = getaddrinfo(host, port, &hints, &res);
+	if (e) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(e));
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+static int ack(int fd, uint64_t sample) {
+	struct frame f;
+
+	f.magic = htonl(FRAME_MAGIC);
+	f.type = htonl(FRAME_ACK);
+	f.sample = htobe64(sample);
+	f.len = htobe64(CREDIT);
+	return send(fd, &f, sizeof(f), MSG_NOSIGNAL) == sizeof(f) ? 0 : -1;
+}
+
+/* Read exactly len bytes, -1 if the connection went away first */
+static int readn(int fd, void *b, size_t len) {
+	ssize_t r;
+
+	while (len) {
+		r = read(fd, b, len);
+		if (r == -1 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		b = (uint8_t *)b + r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int gap(uint64_t next, uint64_t sample) {
+	if (sample == next) return 0;
+	fprintf(stderr, "gap: %llu samples at sample %llu\n",
+	  (unsigned long long)(sample - next), (unsigned long long)next);
+	return 1;
+}
+
+static void out(const void *b, size_t len) {
+	ssize_t r;
+
+	while (len) {
+		r = write(1, b, len);
+		if (r == -1 && errno == EINTR) continue;
+		if (r <= 0) {
+			perror("stdout");
+			exit(1);
+		}
+		b = (const uint8_t *)b + r;
+		len -= r;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[BUFLEN];
+	struct frame f;
+	uint64_t next = 0, acked = 0, len, n;
+	int fd, started = 0, gaps = 0;
+	char *port;
+
+	if (argc != 2 || (port = strrchr(argv[1], ':')) == NULL) {
+		fprintf(stderr, "Usage: %s HOST:PORT > samples.out\n", argv[0]);
+		return 1;
+	}
+	*port++ = '\0';
+
+	for (;; sleep(1)) {
+		fd = dial(argv[1], port);
+		if (fd == -1 || ack(fd, next) != 0) goto drop;
+		for (;;) {
+			if (readn(fd, &f, sizeof(f)) != 0) goto drop;
+			if (ntohl(f.magic) != FRAME_MAGIC) {
+				fprintf(stderr, "%s: bad frame\n", argv[0]);
+				goto drop;
+			}
+			switch (ntohl(f.type)) {
+			case FRAME_START:
+				if (started) gaps += gap(next, be64toh(f.sample));
+				started = 1;
+				next = acked = be64toh(f.sample);
+				break;
+			case FRAME_GAP:
+				/* Thrown away by tsmini2 itself */
+				gaps += gap(next, be64toh(f.sample) + be64toh(f.len));
+				next = be64toh(f.sample) + be64toh(f.len);
+				break;
+			case FRAME_DATA:
+				gaps += gap(next, be64toh(f.sample));
+				next = be64toh(f.sample);
+				for (len = be64toh(f.len); len; len -= n) {
+					n = len < BUFLEN ? len : BUFLEN;
+					if (readn(fd, buf, n) != 0) goto drop;
+					out(buf, n);
+					next += n / SAMPLE_BYTES;
+				}
+				/* Top the credit up once a quarter of it is used */
+				if ((next - acked) * SAMPLE_BYTES >= CREDIT / 4) {
+					if (ack(fd, next) != 0) goto drop;
+					acked = next;
+				}
+				break;
+			case FRAME_END:
+				ack(fd, next);
+				close(fd);
+				return gaps != 0;
+			}
+		}
+drop:
+		if (fd != -1) close(fd);
+		fprintf(stderr, "%s: connection lost at sample %llu, retrying\n",
+		  argv[0], (unsigned long long)next);
+	}
+}
@@ -0,0 +1,201 @@
+/* Receives the datagrams of "tsmini2 --multicast=GROUP:PORT" and writes the
+ * raw sample stream to stdout, same as tsmini2 itself would.
+ *
+ * Example usage:
+ *   ./tsmini2-mcrecv 239.1.2.3:5000 > samples.out
+ *   ./tsmini2-mcrecv 239.1.2.3:5000 127.0.0.1 | ./raw-to-csv
+ *       - The optional second argument picks the interface to join on,
+ *         127.0.0.1 for a receiver on the same machine as tsmini2.
+ *
+ * Datagrams are put back in order within a window of WINDOW datagrams.
+ * Samples that never arrive are left out of the output and reported on
+ * stderr as gaps, with the sample index they were expected at.  Output
+ * starts at the first datagram received and ends with the stream.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Must match tsmini2.c */
+#define MC_MAGIC 0x54534d32
+#define MC_END 1
+#define MC_PAYLOAD 8192
+#define SAMPLE_BYTES 8
+
+struct mc_hdr {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t len;
+	uint64_t seq;
+	uint64_t sample;
+};
+
+#define WINDOW 1024 /* Datagrams held for reordering */
+#define BATCH 64
+#define DGRAM (sizeof(struct mc_hdr) + MC_PAYLOAD)
+
+static struct slot {
+	int full;
+	uint16_t len;
+	uint64_t sample;
+	uint8_t data[MC_PAYLOAD];
+} win[WINDOW];
+
+static uint64_t next_seq, next_sample, nwin;
+static uint64_t gaps, lost, reordered;
+static int started;
+
+static void out(const void *b, size_t len) {
+	ssize_t r;
+
+	while (len) {
+		r = write(1, b, len);
+		if (r == -1 && errno == EINTR) continue;
+		if (r <= 0) {
+			perror("stdout");
+			exit(1);
+		}
+		b = (const uint8_t *)b + r;
+		len -= r;
+	}
+}
+
+/* Write out the datagram at next_seq if there is one, else count a gap */
+static void advance(void) {
+	struct slot *sl = &win[next_seq % WINDOW];
+
+	if (sl->full) {
+		if (sl->sample != next_sample) {
+			fprintf(stderr, "gap: %llu samples at sample %llu\n",
+			  (unsigned long long)(sl->sample - next_sample),
+			  (unsigned long long)next_sample);
+			gaps++;
+			lost += sl->sample - next_sample;
+		}
+		out(sl->data, sl->len);
+		next_sample = sl->sample + sl->len / SAMPLE_BYTES;
+		sl->full = 0;
+		nwin--;
+	}
+	next_seq++;
+}
+
+/* Drain everything held, treating whatever is missing as lost */
+static void flush(void) {
+	while (nwin) advance();
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[BATCH][DGRAM];
+	struct mmsghdr msg[BATCH];
+	struct iovec iov[BATCH];
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	struct timeval tv = { 0, 200000 };
+	struct mc_hdr *h;
+	struct slot *sl;
+	uint64_t seq, end = UINT64_MAX, end_sample = 0;
+	char *port;
+	int fd, sz = 32 << 20, one = 1, i, n;
+
+	if (argc < 2 || argc > 3 || (port = strrchr(argv[1], ':')) == NULL) {
+		fprintf(stderr, "Usage: %s GROUP:PORT [IFADDR] > samples.out\n",
+		  argv[0]);
+		return 1;
+	}
+	*port++ = '\0';
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(strtoul(port, NULL, 0));
+	memset(&mreq, 0, sizeof(mreq));
+	if (inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1 ||
+	  (argc == 3 && inet_pton(AF_INET, argv[2], &mreq.imr_interface) != 1)) {
+		fprintf(stderr, "%s: bad address\n", argv[0]);
+		return 1;
+	}
+	mreq.imr_multiaddr = addr.sin_addr;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	/* Any number of receivers on one machine each get every datagram */
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof(sz)) != 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	  setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < BATCH; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = DGRAM;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (next_seq < end) {
+		n = recvmmsg(fd, msg, BATCH, MSG_WAITFORONE, NULL);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+			/* Quiet for a while, stop waiting for stragglers */
+			flush();
+			if (end != UINT64_MAX) break;
+			continue;
+		} else if (n == -1) {
+			perror("recvmmsg");
+			return 1;
+		}
+		for (i = 0; i < n; i++) {
+			h = (struct mc_hdr *)buf[i];
+			if (msg[i].msg_len < sizeof(*h) || ntohl(h->magic) != MC_MAGIC ||
+			  ntohs(h->len) > msg[i].msg_len - sizeof(*h))
+				continue;
+			seq = be64toh(h->seq);
+			if (!started) {
+				started = 1;
+				next_seq = seq;
+				next_sample = be64toh(h->sample);
+			}
+			if (ntohs(h->flags) & MC_END) {
+				end = seq;
+				end_sample = be64toh(h->sample);
+				continue;
+			}
+			if (seq < next_seq) continue; /* Late, given up on already */
+			if (seq != next_seq + nwin) reordered++;
+			/* No room, the oldest missing datagrams are gone for good */
+			while (seq >= next_seq + WINDOW) advance();
+			sl = &win[seq % WINDOW];
+			if (sl->full) continue; /* Duplicate */
+			sl->full = 1;
+			sl->len = ntohs(h->len);
+			sl->sample = be64toh(h->sample);
+			memcpy(sl->data, h + 1, sl->len);
+			nwin++;
+			while (win[next_seq % WINDOW].full) advance();
+		}
+	}
+	flush();
+	if (started && end != UINT64_MAX && next_sample < end_sample) {
+		fprintf(stderr, "gap: %llu samples at sample %llu\n",
+		  (unsigned long long)(end_sample - next_sample),
+		  (unsigned long long)next_sample);
+		gaps++;
+		lost += end_sample - next_sample;
+	}
+	fprintf(stderr, "%s: %llu gaps, %llu samples lost, %llu datagrams out "
+	  "of order\n", argv[0], (unsigned long long)gaps,
+	  (unsigned long long)lost, (unsigned long long)reordered);
+	return gaps != 0;
+}
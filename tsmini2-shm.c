@@ -0,0 +1,184 @@
+/* Client side of "tsmini2 --shm=NAME", see tsmini2-shm.h */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "tsmini2-shm.h"
+
+static int claim_slot(struct tsmini2_shm *h) {
+	uint32_t pid = getpid(), old;
+	int i;
+
+	for (i = 0; i < TSMINI2_SHM_READERS; i++) {
+		old = atomic_load(&h->reader[i].pid);
+		/* Free, or left behind by a reader that died */
+		if (old && (kill(old, 0) == 0 || errno != ESRCH)) continue;
+		if (atomic_compare_exchange_strong(&h->reader[i].pid, &old, pid))
+			return i;
+	}
+	return -1;
+}
+
+int tsmini2_shm_attach(struct tsmini2_reader *r, const char *name) {
+	struct stat st;
+	uint8_t *p;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = shm_open(name, O_RDWR, 0);
+	if (r->fd == -1) return -1;
+	if (fstat(r->fd, &st) == -1) goto fail;
+	r->hdr = mmap(0, TSMINI2_SHM_HDR, PROT_READ|PROT_WRITE, MAP_SHARED,
+	  r->fd, 0);
+	if (r->hdr == MAP_FAILED) goto fail;
+	if (memcmp(r->hdr->magic, TSMINI2_SHM_MAGIC, 8) != 0 ||
+	  r->hdr->version != TSMINI2_SHM_VERSION ||
+	  (uint64_t)st.st_size != TSMINI2_SHM_HDR + r->hdr->size) {
+		munmap(r->hdr, TSMINI2_SHM_HDR);
+		errno = EPROTO;
+		goto fail;
+	}
+	r->size = r->hdr->size;
+
+	/* Same double mapping as tsmini2's own */
+	p = mmap(0, 2 * r->size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) goto fail_hdr;
+	if (mmap(p, r->size, PROT_READ, MAP_SHARED|MAP_FIXED, r->fd,
+	  TSMINI2_SHM_HDR) == MAP_FAILED || mmap(p + r->size, r->size, PROT_READ,
+	  MAP_SHARED|MAP_FIXED, r->fd, TSMINI2_SHM_HDR) == MAP_FAILED) {
+		munmap(p, 2 * r->size);
+		goto fail_hdr;
+	}
+	r->buf = p;
+
+	r->slot = claim_slot(r->hdr);
+	if (r->slot < 0) {
+		munmap(r->buf, 2 * r->size);
+		errno = EBUSY;
+		goto fail_hdr;
+	}
+	r->pos = atomic_load(&r->hdr->put);
+	/* Gaps from before we came are none of ours */
+	r->kgap = atomic_load(&r->hdr->ngap);
+	if (r->kgap)
+		r->kgap_total = r->hdr->gap[(r->kgap - 1) % TSMINI2_SHM_GAPS].total;
+	atomic_store(&r->hdr->reader[r->slot].lost, 0);
+	atomic_store(&r->hdr->reader[r->slot].get, r->pos);
+	return 0;
+
+fail_hdr:
+	munmap(r->hdr, TSMINI2_SHM_HDR);
+fail:
+	close(r->fd);
+	return -1;
+}
+
+void tsmini2_shm_detach(struct tsmini2_reader *r) {
+	atomic_store(&r->hdr->reader[r->slot].pid, 0);
+	munmap(r->buf, 2 * r->size);
+	munmap(r->hdr, TSMINI2_SHM_HDR);
+	close(r->fd);
+}
+
+/* Copy out gap k, 0 if tsmini2 has recycled it */
+static int gap_get(struct tsmini2_shm *h, uint64_t k,
+  struct tsmini2_shm_gap *g) {
+	*g = h->gap[k % TSMINI2_SHM_GAPS];
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&h->ngap, memory_order_relaxed) - k <=
+	  TSMINI2_SHM_GAPS;
+}
+
+/* How much of n bytes at the cursor comes before the next gap */
+static uint64_t gap_clip(struct tsmini2_reader *r, uint64_t n) {
+	uint64_t ng = atomic_load_explicit(&r->hdr->ngap, memory_order_acquire), k;
+	struct tsmini2_shm_gap g;
+
+	for (k = ng; k > 0 && ng - k < TSMINI2_SHM_GAPS; k--) {
+		if (!gap_get(r->hdr, k - 1, &g) || g.pos <= r->pos) break;
+		if (g.pos < r->pos + n) n = g.pos - r->pos;
+	}
+	return n;
+}
+
+static void skip(struct tsmini2_reader *r, uint64_t to) {
+	atomic_fetch_add(&r->hdr->reader[r->slot].lost, to - r->pos);
+	r->pos = to;
+	atomic_store(&r->hdr->reader[r->slot].get, to);
+}
+
+int64_t tsmini2_shm_wait(struct tsmini2_reader *r, int timeout_ms) {
+	struct tsmini2_shm *h = r->hdr;
+	struct timespec ts, *tp = NULL;
+	uint64_t put;
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+		tp = &ts;
+	}
+	for (;;) {
+		put = atomic_load_explicit(&h->put, memory_order_acquire);
+		if (put == r->pos && !h->done) {
+			h->parked = 1;
+			put = atomic_load(&h->put);
+		}
+		if (put == r->pos && !h->done) {
+			if (syscall(SYS_futex, &h->parked, FUTEX_WAIT, 1, tp, NULL, 0)
+			  == -1 && errno == ETIMEDOUT)
+				return 0;
+			continue;
+		}
+		if (put - r->pos <= h->size - 2 * h->slack)
+			return gap_clip(r, put - r->pos);
+		skip(r, put);
+	}
+}
+
+uint64_t tsmini2_shm_consume(struct tsmini2_reader *r, uint64_t len) {
+	struct tsmini2_shm *h = r->hdr;
+	uint64_t put, lost = 0;
+
+	/* Was tsmini2 possibly writing over any of it while we looked? */
+	atomic_thread_fence(memory_order_acquire);
+	put = atomic_load_explicit(&h->put, memory_order_relaxed);
+	if (put + h->slack - r->pos > h->size) {
+		lost = put - r->pos;
+		skip(r, put);
+		return lost;
+	}
+	r->pos += len;
+	atomic_store_explicit(&h->reader[r->slot].get, r->pos,
+	  memory_order_release);
+	return 0;
+}
+
+int tsmini2_shm_gap(struct tsmini2_reader *r, struct tsmini2_shm_gap *g) {
+	struct tsmini2_shm *h = r->hdr;
+	uint64_t ng;
+
+	for (;;) {
+		ng = atomic_load_explicit(&h->ngap, memory_order_acquire);
+		if (r->kgap == ng) return 0;
+		if (ng - r->kgap > TSMINI2_SHM_GAPS) {
+			/* Missed some, they count towards the next one */
+			r->kgap = ng - TSMINI2_SHM_GAPS;
+			continue;
+		}
+		if (!gap_get(h, r->kgap, g)) continue;
+		if (g->pos > r->pos) return 0;
+		g->lost = g->total - r->kgap_total;
+		r->kgap_total = g->total;
+		r->kgap++;
+		return 1;
+	}
+}
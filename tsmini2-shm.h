@@ -0,0 +1,98 @@
+/* Shared-memory access to a running "tsmini2 --shm=NAME".
+ *
+ * The POSIX shared memory object NAME holds a one page header followed by
+ * the sample FIFO itself, which readers map twice back to back like tsmini2
+ * does, so any run of bytes at the cursor is contiguous.  Readers never hold
+ * tsmini2 back: one that falls too far behind (or crashes) simply loses
+ * data, and is told how much.
+ *
+ * Example:
+ *   struct tsmini2_reader r;
+ *   struct tsmini2_shm_gap g;
+ *   int64_t n;
+ *
+ *   if (tsmini2_shm_attach(&r, "/tsmini2") != 0) ...
+ *   while ((n = tsmini2_shm_wait(&r, -1)) > 0) {
+ *       process(tsmini2_shm_data(&r), n);
+ *       if (tsmini2_shm_consume(&r, n) > 0) ... data was overwritten
+ *       while (tsmini2_shm_gap(&r, &g)) ... tsmini2 lost g.lost samples
+ *   }
+ *   tsmini2_shm_detach(&r);
+ */
+#ifndef TSMINI2_SHM_H
+#define TSMINI2_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define TSMINI2_SHM_MAGIC "tsmini2"
+#define TSMINI2_SHM_VERSION 2
+#define TSMINI2_SHM_HDR 4096 /* FIFO data starts this far into the object */
+#define TSMINI2_SHM_READERS 16
+#define TSMINI2_SHM_GAPS 64
+
+/* Samples tsmini2 itself threw away with its FIFO full (--overflow=drop-*).
+ * Gap k is in gap[k % TSMINI2_SHM_GAPS] once ngap is past it.
+ */
+struct tsmini2_shm_gap {
+	uint64_t pos;   /* FIFO position the gap comes just before */
+	uint64_t lost;  /* Samples lost there */
+	uint64_t total; /* Samples lost up to and including this gap */
+};
+
+struct tsmini2_shm {
+	char magic[8];
+	uint32_t version, sample_bytes;
+	uint64_t size;  /* FIFO bytes */
+	uint64_t slack; /* tsmini2 may be writing up to this far past put */
+	uint64_t rate;  /* Nominal bytes per second */
+	_Alignas(64) _Atomic uint64_t put; /* Bytes written since the start */
+	_Atomic uint32_t done;             /* tsmini2 exit status + 1 */
+	_Alignas(64) _Atomic uint32_t parked; /* Futex word for waiting readers */
+	struct {
+		_Alignas(64) _Atomic uint32_t pid; /* 0 if the slot is free */
+		_Atomic uint64_t get, lost;
+	} reader[TSMINI2_SHM_READERS];
+	_Alignas(64) _Atomic uint64_t ngap; /* Gaps logged since the start */
+	struct tsmini2_shm_gap gap[TSMINI2_SHM_GAPS];
+};
+
+struct tsmini2_reader {
+	struct tsmini2_shm *hdr;
+	uint8_t *buf;
+	uint64_t size, pos;
+	uint64_t kgap, kgap_total; /* Next gap to pass on, total up to it */
+	int slot, fd;
+};
+
+/* Map NAME and start reading at the newest data.  Returns 0 or -1/errno. */
+int tsmini2_shm_attach(struct tsmini2_reader *r, const char *name);
+void tsmini2_shm_detach(struct tsmini2_reader *r);
+
+/* Wait up to timeout_ms (-1 forever) for data at the cursor.  Returns the
+ * byte count at tsmini2_shm_data(), 0 on timeout or once tsmini2 has
+ * finished and everything was read (hdr->done says how it exited).  A
+ * reader about to be lapped is moved up to the newest data first; the bytes
+ * skipped are added to hdr->reader[slot].lost.  The count stops short of
+ * the next gap, so data on either side of one is never returned together.
+ */
+int64_t tsmini2_shm_wait(struct tsmini2_reader *r, int timeout_ms);
+
+static inline const uint8_t *tsmini2_shm_data(struct tsmini2_reader *r) {
+	return r->buf + r->pos % r->size;
+}
+
+/* Move the cursor len bytes on.  Returns 0 if those bytes were still
+ * intact after the reader was done with them, else the number of bytes lost
+ * (the cursor then jumps to the newest data).
+ */
+uint64_t tsmini2_shm_consume(struct tsmini2_reader *r, uint64_t len);
+
+/* Returns 1 and fills *g for each gap at or before the cursor not passed on
+ * yet, 0 when there are none.  g->lost also counts gaps the reader jumped
+ * over or that were recycled before it looked; the samples lost come just
+ * before sample g->pos / sample_bytes + g->total - g->lost.
+ */
+int tsmini2_shm_gap(struct tsmini2_reader *r, struct tsmini2_shm_gap *g);
+
+#endif
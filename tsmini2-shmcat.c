@@ -0,0 +1,57 @@
+/* Copies the sample stream of a running "tsmini2 --shm=NAME" to stdout,
+ * mostly as an example of using tsmini2-shm.h.
+ *
+ * Example usage:
+ *   ./tsmini2 --shm=/tsmini2 --output=samples.out &
+ *   ./tsmini2-shmcat /tsmini2 | some_filter_process
+ *
+ * Data the reader lost by falling behind is reported on stderr, and so are
+ * samples tsmini2 itself lost, with the sample index they were lost at.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "tsmini2-shm.h"
+
+int main(int argc, char **argv)
+{
+	struct tsmini2_reader r;
+	struct tsmini2_shm_gap g;
+	int64_t n;
+	ssize_t wr;
+	uint64_t lost;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s NAME > samples.out\n", argv[0]);
+		return 1;
+	}
+	if (tsmini2_shm_attach(&r, argv[1]) != 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	while ((n = tsmini2_shm_wait(&r, -1)) > 0) {
+		while (tsmini2_shm_gap(&r, &g))
+			fprintf(stderr, "%s: tsmini2 lost %llu samples at sample %llu\n",
+			  argv[0], (unsigned long long)g.lost, (unsigned long long)
+			  (g.pos / r.hdr->sample_bytes + g.total - g.lost));
+		if (n > 0x200000) n = 0x200000;
+		wr = write(1, tsmini2_shm_data(&r), n);
+		if (wr == -1 && errno == EINTR) continue;
+		if (wr <= 0) {
+			perror("stdout");
+			return 1;
+		}
+		/* A late check: the bytes are in stdout already if it fails */
+		lost = tsmini2_shm_consume(&r, wr);
+		if (lost)
+			fprintf(stderr, "%s: lost %llu bytes\n", argv[0],
+			  (unsigned long long)lost);
+	}
+	n = r.hdr->done - 1;
+	tsmini2_shm_detach(&r);
+	return n;
+}
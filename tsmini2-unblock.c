@@ -0,0 +1,224 @@
+/* Strips the framing from "tsmini2 --blocks" and writes the raw sample
+ * stream to stdout, checking every block on the way (see tsmini2-blocks.h).
+ *
+ * Example usage:
+ *   ./tsmini2 --blocks | ./tsmini2-unblock > samples.out
+ *   ./tsmini2-unblock -l < blocks.out > /dev/null
+ *       - With -l, also list every block header on stderr.
+ *
+ * Samples tsmini2 lost, blocks missing from the stream and blocks that fail
+ * their CRC are reported on stderr; damaged blocks are left out of the
+ * output.  The exit status is 1 if there was any of that.
+ *
+ * Blocks reduced by "tsmini2 --shed" or "--channels" are put back to 4
+ * channels at the full rate so the output stays one sample stream: dropped
+ * channels read 0 and averaged samples are repeated.  Each stage change is
+ * reported on stderr.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+
+#include "tsmini2-blocks.h"
+
+#define MAX_BLOCK 0x200000 /* Must match MAX_WRITE in tsmini2.c */
+#define SAMPLE_BYTES 8
+#define BUFLEN (4 * MAX_BLOCK)
+
+static uint8_t buf[BUFLEN];
+static int16_t unpacked[MAX_BLOCK / 2], expanded[MAX_BLOCK / 2];
+static size_t have, off;
+static int eof;
+
+/* Make sure there are need bytes at off, 0 if the input ends first */
+static int fill(size_t need) {
+	ssize_t r;
+
+	if (have - off >= need) return 1;
+	memmove(buf, buf + off, have - off);
+	have -= off;
+	off = 0;
+	while (have < need && !eof) {
+		r = read(0, buf + have, BUFLEN - have);
+		if (r == -1 && errno == EINTR) continue;
+		if (r == -1) {
+			perror("stdin");
+			exit(1);
+		}
+		if (r == 0) eof = 1;
+		have += r;
+	}
+	return have >= need;
+}
+
+static void out(const void *b, size_t len) {
+	ssize_t r;
+
+	while (len) {
+		r = write(1, b, len);
+		if (r == -1 && errno == EINTR) continue;
+		if (r <= 0) {
+			perror("stdout");
+			exit(1);
+		}
+		b = (const uint8_t *)b + r;
+		len -= r;
+	}
+}
+
+/* A header in host byte order, or 0 if what is at off is not one */
+static int header(struct tsmini2_blk *h) {
+	memcpy(h, buf + off, sizeof(*h));
+	if (le32toh(h->magic) != TSMINI2_BLK_MAGIC ||
+	  le32toh(h->hdr_crc) != tsmini2_crc32c(0, h,
+	  offsetof(struct tsmini2_blk, hdr_crc)))
+		return 0;
+	h->version = le16toh(h->version);
+	h->hdr_len = le16toh(h->hdr_len);
+	h->seq = le64toh(h->seq);
+	h->sample = le64toh(h->sample);
+	h->realtime_ns = le64toh(h->realtime_ns);
+	h->mono_ns = le64toh(h->mono_ns);
+	h->len = le32toh(h->len);
+	h->channels = le16toh(h->channels);
+	h->bits = le16toh(h->bits);
+	h->config = le32toh(h->config);
+	h->flags = le32toh(h->flags);
+	h->crc = le32toh(h->crc);
+	return h->hdr_len >= sizeof(*h) && h->hdr_len <= 4096 &&
+	  h->len <= MAX_BLOCK && h->channels && h->bits;
+}
+
+/* Undo --shed: p is the payload of h, the result 4 channels at full rate in
+ * *len bytes, NULL if it does not add up.  *n is the input samples covered.
+ */
+static const void *expand(const struct tsmini2_blk *h, const uint8_t *p,
+  uint32_t *len, uint64_t *n) {
+	uint32_t keep = TSMINI2_BLK_CHANS(h->flags), d = TSMINI2_BLK_DECIM(h->flags);
+	const int16_t *in = (const int16_t *)p;
+	size_t i, j, c, k, m = h->len;
+
+	if (h->flags & TSMINI2_BLK_PACKED) {
+		m = tsmini2_unpack(unpacked, sizeof(unpacked), p, h->len, h->channels);
+		if (m == 0) return NULL;
+		in = unpacked;
+	}
+	if (m % (h->channels * h->bits / 8)) return NULL;
+	m /= h->channels * h->bits / 8;
+	*n = m * d;
+	if (keep == 0 && d == 1) {
+		*len = m * SAMPLE_BYTES;
+		return in;
+	}
+	if (keep == 0) keep = 0xf;
+	if (h->bits != 16 || __builtin_popcount(keep) != h->channels ||
+	  *n * SAMPLE_BYTES > sizeof(expanded))
+		return NULL;
+	for (i = 0; i < m; i++, in += h->channels)
+		for (j = 0; j < d; j++)
+			for (c = 0, k = 0; c < 4; c++)
+				expanded[(i * d + j) * 4 + c] = keep & 1 << c ? in[k++] : 0;
+	*len = *n * SAMPLE_BYTES;
+	return expanded;
+}
+
+int main(int argc, char **argv)
+{
+	struct tsmini2_blk h;
+	uint64_t seq = 0, sample = 0, blocks = 0, lost = 0, missing = 0, bad = 0;
+	uint64_t junk = 0, n;
+	uint32_t magic = htole32(TSMINI2_BLK_MAGIC), len;
+	int list = 0, started = 0, stage = 0, resync = 0;
+	const void *o;
+	uint8_t *p;
+
+	if (argc == 2 && strcmp(argv[1], "-l") == 0) list = 1;
+	else if (argc != 1) {
+		fprintf(stderr, "Usage: %s [-l] < blocks > samples.out\n", argv[0]);
+		return 1;
+	}
+
+	while (fill(sizeof(h))) {
+		if (!header(&h)) {
+			/* Damaged or not a header, look for the next one */
+			p = memmem(buf + off + 1, have - off - 1, &magic, 4);
+			if (p == NULL) p = buf + have - 3;
+			junk += p - (buf + off);
+			off = p - buf;
+			continue;
+		}
+		if (!fill(h.hdr_len + h.len)) break;
+		if (junk) {
+			fprintf(stderr, "%llu bytes of junk before block %llu\n",
+			  (unsigned long long)junk, (unsigned long long)h.seq);
+			junk = 0;
+			bad++;
+		}
+		if (list)
+			fprintf(stderr, "block %llu sample %llu len %u realtime %llu.%09llu "
+			  "mono %llu.%09llu channels %u bits %u config 0x%08x "
+			  "flags 0x%08x\n",
+			  (unsigned long long)h.seq, (unsigned long long)h.sample, h.len,
+			  (unsigned long long)h.realtime_ns / 1000000000,
+			  (unsigned long long)h.realtime_ns % 1000000000,
+			  (unsigned long long)h.mono_ns / 1000000000,
+			  (unsigned long long)h.mono_ns % 1000000000,
+			  h.channels, h.bits, h.config, h.flags);
+		if (started && h.seq != seq) {
+			fprintf(stderr, "%lld blocks missing before block %llu\n",
+			  (long long)(h.seq - seq), (unsigned long long)h.seq);
+			missing += h.seq - seq;
+		} else if (started && !resync && h.sample != sample) {
+			fprintf(stderr, "tsmini2 lost %lld samples at sample %llu\n",
+			  (long long)(h.sample - sample), (unsigned long long)sample);
+			lost += h.sample - sample;
+		}
+		if (TSMINI2_BLK_STAGE(h.flags) != stage) {
+			stage = TSMINI2_BLK_STAGE(h.flags);
+			fprintf(stderr, "shed stage %d from sample %llu: %s%s%s\n", stage,
+			  (unsigned long long)h.sample,
+			  h.flags & TSMINI2_BLK_PACKED ? "delta coded" : "full",
+			  TSMINI2_BLK_CHANS(h.flags) ? ", some channels" : "",
+			  TSMINI2_BLK_DECIM(h.flags) > 1 ? ", averaged" : "");
+		}
+		started = 1;
+		resync = 0;
+		seq = h.seq + 1;
+		p = buf + off + h.hdr_len;
+		off += h.hdr_len + h.len;
+		o = NULL;
+		if (tsmini2_crc32c(0, p, h.len) != h.crc)
+			fprintf(stderr, "block %llu (sample %llu): bad CRC, left out\n",
+			  (unsigned long long)h.seq, (unsigned long long)h.sample);
+		else if ((o = expand(&h, p, &len, &n)) == NULL)
+			fprintf(stderr, "block %llu (sample %llu): does not decode, left "
+			  "out\n", (unsigned long long)h.seq, (unsigned long long)h.sample);
+		if (o == NULL) {
+			bad++;
+			/* How many samples a reduced block held is not known */
+			resync = !!(h.flags & TSMINI2_BLK_PACKED);
+			sample = h.sample + h.len / (h.channels * h.bits / 8) *
+			  TSMINI2_BLK_DECIM(h.flags);
+			continue;
+		}
+		sample = h.sample + n;
+		out(o, len);
+		blocks++;
+	}
+	if (have != off) {
+		fprintf(stderr, "%llu bytes left over at the end\n",
+		  (unsigned long long)(have - off));
+		bad++;
+	}
+	fprintf(stderr, "%s: %llu blocks, %llu missing, %llu bad, %llu samples "
+	  "lost by tsmini2\n", argv[0], (unsigned long long)blocks,
+	  (unsigned long long)missing, (unsigned long long)bad,
+	  (unsigned long long)lost);
+	return missing || bad || lost;
+}
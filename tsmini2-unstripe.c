@@ -0,0 +1,93 @@
+/* Reassembles a capture striped by "tsmini2 --stripe" and writes the original
+ * sample stream to stdout.
+ *
+ * Example usage:
+ *   ./tsmini2-unstripe /mnt/ssd0/tsmini2.manifest > samples.out
+ *
+ * If the capture did not end cleanly the manifest has no length, in which
+ * case output stops at the first block missing from its stripe file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#define STRIPE_MAX 16
+
+int main(int argc, char **argv)
+{
+	char line[PATH_MAX + 16], path[PATH_MAX];
+	unsigned long long block = 0, length = UINT64_MAX, v, k;
+	int fd[STRIPE_MAX], n = 0, stripes = 0, ver = 0;
+	uint8_t *buf;
+	ssize_t rd, wr, len;
+	FILE *f;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s MANIFEST > samples.out\n", argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[1], "r");
+	if (f == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "tsmini2-stripe %d", &ver) == 1) continue;
+		else if (sscanf(line, "block %llu", &v) == 1) block = v;
+		else if (sscanf(line, "stripes %d", &stripes) == 1) continue;
+		else if (sscanf(line, "length %llu", &v) == 1) length = v;
+		else if (sscanf(line, "stripe %4095[^\n]", path) == 1) {
+			if (n == STRIPE_MAX) break;
+			fd[n] = open(path, O_RDONLY);
+			if (fd[n] == -1) {
+				perror(path);
+				return 1;
+			}
+			n++;
+		}
+	}
+	fclose(f);
+
+	if (ver != 1 || block == 0 || stripes == 0 || n != stripes) {
+		fprintf(stderr, "%s: not a tsmini2 stripe manifest\n", argv[1]);
+		return 1;
+	}
+
+	buf = malloc(block);
+	if (buf == NULL) {
+		fprintf(stderr, "Memory allocation failed\n");
+		return 1;
+	}
+
+	for (k = 0; k * block < length; k++) {
+		len = length - k * block < block ? length - k * block : block;
+		rd = pread(fd[k % n], buf, len, k / n * block);
+		if (rd == -1) {
+			perror("pread");
+			return 1;
+		}
+		for (wr = 0; wr < rd; ) {
+			ssize_t r = write(1, buf + wr, rd - wr);
+			if (r == -1) {
+				perror("stdout");
+				return 1;
+			}
+			wr += r;
+		}
+		if (rd < len) {
+			if (length != UINT64_MAX) {
+				fprintf(stderr, "Stripe %llu is short at block %llu\n",
+				  k % n, k);
+				return 1;
+			}
+			break;
+		}
+	}
+
+	return 0;
+}
@@ -1,11 +1,11 @@
 /* This program takes the 40 MBytes/sec of samples from the TS-MINI ADC and
  * sends it to stdout.  It uses realtime priority and locks 512 MBytes of RAM
- * for a software FIFO.  If stdout can not keep up with 40MBytes/sec, the 512
- * Mbyte software FIFO will eventually overflow.  When it does, it will stop
- * acquiring samples from the TS-MINI, flush the remaining 512MBytes of sample
- * backlog, and then terminate gracefully with exit state 1.  If stdout can 
- * keep up with 40MBytes/sec, the sample stream outputs forever or until EOF 
- * or signal termination.
+ * (see --fifo-size) for a software FIFO.  If stdout can not keep up with
+ * 40MBytes/sec, the 512 Mbyte software FIFO will eventually overflow.  When
+ * it does, it will stop acquiring samples from the TS-MINI, flush the
+ * remaining 512MBytes of sample backlog, and then terminate gracefully with
+ * exit state 1.  If stdout can keep up with 40MBytes/sec, the sample stream
+ * outputs forever or until EOF or signal termination.
  *
  * Example usage:
  *   nc -e ./tsmini2 192.168.1.30 1234
@@ -15,6 +15,10 @@
  *   ./tsmini2 > samples.out
  *       - Capture samples to file storage for later processing.  
  *
+ *   ./tsmini2 --output=samples.out
+ *       - Same as above, but written with io_uring and O_DIRECT so the
+ *         page cache and writeback stalls stay out of the way.
+ *
  *   ./tsmini2 | some_filter_process > samples.out
  *       - Same as above, but send samples through a custom util 
  *         named "some_filter_process".  Processes in pipelines allow multiple
@@ -24,7 +28,66 @@
  *       - Use the NetCat utility to listen for an incoming TCP connection on
  *         port 1234 and send samples to the remote system.
  *
+ *   ./tsmini2 --listen=1234
+ *       - Same as above without NetCat, and clients may come and go:
+ *         samples queue in the FIFO while nobody is connected.
+ *
+ *   ./tsmini2 --output=samples.out --listen=1234 --stdout --lossy=stdout |
+ *     some_monitor
+ *       - All at once from the one FIFO, without tee.  The monitor gets
+ *         whatever it can keep up with; disk and network get everything.
+ *
+ *   ./tsmini2 --shm=/tsmini2 --output=samples.out &
+ *   ./tsmini2-shmcat /tsmini2 | some_filter_process
+ *       - Let any number of local processes read the FIFO in place (see
+ *         tsmini2-shm.h) while the capture goes to disk.
+ *
+ *   ./tsmini2 --listen=1234 --framed
+ *       - Same, for "tsmini2-fetch host:1234 > samples.out" on the remote
+ *         system, which survives dropped connections without losing data.
+ *
+ *   ./tsmini2 --multicast=239.1.2.3:5000
+ *       - Send samples to every host running "tsmini2-mcrecv 239.1.2.3:5000"
+ *         at the cost of one stream.  Lost datagrams show up as reported
+ *         gaps on the receiving end, nothing is resent.
+ *
+ *   ./tsmini2 --blocks | ./tsmini2-unblock | ./raw-to-csv
+ *       - Same data, checked end to end: every block carries its sample
+ *         index, timestamps, the config register and a CRC32C.
+ *
+ *   ./tsmini2 --blocks --shed=5 | ssh host 'tsmini2-unblock > samples.out'
+ *       - If the link can not keep up and the FIFO would fill within 5s,
+ *         send less: delta coded, then channels 1-2 only, then averaged
+ *         down to 1.25 MS/s, and back up once it catches up.  Every block
+ *         says which.
+ *
+ *   ./tsmini2 --listen=1234 --spill=/mnt/scratch/tsmini2.spill
+ *       - Let the client lag by up to 16G instead of the FIFO size: the
+ *         backlog past half the FIFO goes to the scratch file and is read
+ *         back from there in order.
+ *
+ *   ./tsmini2 --channels=1,2 --crc --minmax --stats --output=samples.out
+ *       - Capture only channels 1 and 2, half the bytes.  At exit --stats
+ *         gives each channel's range and the CRC32C of all that was written,
+ *         all worked out in the one pass that copies the samples in.
+ *
+ *   ./tsmini2 --pin=producer:2 --pin=output:3 --output=samples.out
+ *       - Keep the DMA poll and the capture each on a CPU of its own, say
+ *         ones set aside with isolcpus=2,3.  The FIFO goes on the card's
+ *         NUMA node unless --numa says otherwise; --pin=output:node would
+ *         put the capture next to it.
+ *
+ *   ./tsmini2 --overflow=drop-oldest --output=samples.out --listen=1234
+ *       - Keep acquiring when the sinks fall behind and the FIFO fills,
+ *         throwing away the oldest backlog.  Every loss is reported on stderr
+ *         with its sample index, and in-band on --framed and --multicast.
+ *
+ *   ./tsmini2 --backend=sim --sim-rate=4 > /dev/null
+ *       - Exercise the acquisition and output path without a card, using a
+ *         simulated TS-MINI producing samples at 4x the real rate.
+ *
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -37,33 +100,528 @@
 #include <termios.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/uio.h>
+#include <linux/sockios.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
 #include <assert.h>
 #include <sched.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include "tsmini2-shm.h"
+#include "tsmini2-blocks.h"
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#define BUFSIZE (512 * 0x100000)
+#define BUFSIZE (512 * 0x100000) /* Default soft FIFO size */
 #define MAX_WRITE 0x200000
 #define MAX_LATENCY_US 100000
 
+/* TS-MINI BAR0 register map */
+#define REG_CFG 0x0        /* Revision, coupling and FIR config */
+#define REG_DMABASE 0x4    /* DMA ring physical base, write re-arms DMA */
+#define REG_DMAPTR 0x8     /* Last DMA write address, bit 0 is hard overflow */
+#define REG_CN1 0x10       /* CN1 outputs and SPI flash bit-bang */
+
+#define DMA_RING_SIZE 0x200000 /* What the ring is unless udmabuf0 says */
+#define DMA_RING_MIN 0x10000
+#define FPGA_FIXED_RING_REV 3  /* Up to here the FPGA wraps at DMA_RING_SIZE */
+#define UDMABUF_SYSFS "/sys/class/udmabuf/udmabuf0/"
+#define SAMPLE_RATE 5000000 /* Per channel, 4x 16-bit channels */
+#define SAMPLE_BYTES 8
+
+/* A backend provides the register file and the DMA ring.  "pci" is the real
+ * TS-MINI, "sim" is a software model for testing without a card.  sync, if
+ * there is one, hands len bytes of the ring at off to the CPU (cpu set) or
+ * back to the card.
+ */
+struct backend {
+	const char *name;
+	int (*open_regs)(void);
+	int (*open_dma)(void);
+	uint32_t (*rd)(uint32_t reg);
+	void (*wr)(uint32_t reg, uint32_t val);
+	void (*sync)(uint32_t off, uint32_t len, int cpu);
+};
+
+static struct backend *dev;
 static void *fpga, *dmabuf;
 static uint32_t reg10h;
 static uint32_t dmabuf_phys;
-static uint32_t last, get;
-static volatile uint32_t put, nf;
-static uint8_t *buf;
-static pthread_mutex_t buflock;
-static pthread_cond_t bufcond = PTHREAD_COND_INITIALIZER;
+static uint32_t last;
+
+/* The DMA ring geometry, a power of two found at startup.  Positions in the
+ * ring (DMA cursors) are byte offsets from its base, and all arithmetic on
+ * them goes through ring_dist() and ring_adv().
+ */
+static struct {
+	uint32_t size, mask;
+} ring = { DMA_RING_SIZE, DMA_RING_SIZE - 1 };
+
+/* Bytes from cursor from up to cursor to */
+static inline uint32_t ring_dist(uint32_t from, uint32_t to) {
+	return (to - from) & ring.mask;
+}
+
+static inline uint32_t ring_adv(uint32_t pos, uint32_t n) {
+	return (pos + n) & ring.mask;
+}
+
+/* Each producer batch is logged with the time its data was seen in the DMA
+ * ring, so consumers can tell how old a FIFO position is.
+ */
+#define NBATCH 4096
+struct batch {
+	uint64_t end;  /* FIFO position just past the batch */
+	uint64_t mono; /* CLOCK_MONOTONIC ns when REG_DMAPTR was read */
+	uint32_t crc;  /* --crc: CRC32C of the FIFO stream up to end */
+	int16_t min[4], max[4]; /* --minmax: per channel, in the batch */
+};
+
+/* Samples fpga_loop() had to throw away with the FIFO full, in FIFO order.
+ * total covers every gap so far, so the sample index at any FIFO position
+ * stays known when entries are recycled.
+ */
+#define NGAP 64
+struct gap {
+	uint64_t pos;   /* FIFO position the gap comes just before */
+	uint64_t lost;  /* Samples lost there */
+	uint64_t total; /* Samples lost up to and including this gap */
+};
+
+/* Soft FIFO.  fpga_loop() is the only producer and the stdout writer the
+ * only consumer, so no lock is needed: put and get are free-running byte
+ * counts, each written by one side only and kept on separate cache lines.
+ * Consumers sleep on the "parked" futex and are woken only if one is
+ * actually parked.
+ */
+struct fifo {
+	uint8_t *buf;
+	uint64_t size;
+	uint32_t sample_bytes; /* SAMPLE_BYTES, less with --channels */
+	_Alignas(64) _Atomic uint64_t put;
+	_Alignas(64) _Atomic uint64_t get;
+	_Alignas(64) _Atomic uint32_t parked;
+	_Atomic int done; /* Producer exit status + 1 */
+	int evfd;         /* eventfd also signalled on wakeup, for epoll users */
+	struct tsmini2_shm *shm; /* Header if the FIFO is published with --shm */
+	_Alignas(64) _Atomic uint64_t nbatch;
+	struct batch batch[NBATCH];
+	_Alignas(64) _Atomic uint64_t ngap;
+	struct gap gap[NGAP];
+};
+
+static struct fifo fifo;
+
+static inline uint32_t reg_rd(uint32_t reg) {
+	return dev->rd(reg);
+}
+
+static inline void reg_wr(uint32_t reg, uint32_t val) {
+	dev->wr(reg, val);
+}
+
+static inline void dma_sync(uint32_t off, uint32_t len, int cpu) {
+	if (dev->sync) dev->sync(off, len, cpu);
+}
+
+static uint64_t now_ns(clockid_t clk) {
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Map size bytes of fd twice back to back, so that a span of up to size
+ * bytes starting anywhere in the first copy is contiguous in memory.
+ */
+static void *map_twice(int fd, uint64_t size, off_t off) {
+	uint8_t *p;
+
+	p = mmap(0, 2 * size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return p;
+	if (mmap(p, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, off)
+	  == MAP_FAILED || mmap(p + size, size, PROT_READ|PROT_WRITE,
+	  MAP_SHARED|MAP_FIXED, fd, off) == MAP_FAILED) {
+		munmap(p, 2 * size);
+		return MAP_FAILED;
+	}
+	return p;
+}
+
+static int pci_open_regs(void) {
+	int fpgafd;
+
+	fpgafd = open("/tsmini2/resource0", O_RDWR|O_SYNC);
+	if (fpgafd == -1) {
+		perror("/tsmini2/resource0");
+		return 3;
+	}
+
+	fpga = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fpgafd, 0);
+	assert (fpga != (void *)-1);
+	return 0;
+}
+
+static int sysfs_num(const char *path, unsigned long long *v) {
+	FILE *f = fopen(path, "r");
+	int r;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	r = fscanf(f, "%lli", v);
+	fclose(f);
+	if (r != 1) fprintf(stderr, "%s: not a number\n", path);
+	return r == 1 ? 0 : -1;
+}
+
+/* Size the ring from udmabuf0 and check the FPGA agrees on where it is.  Older
+ * bitstreams wrap at DMA_RING_SIZE whatever udmabuf0's size, so it must be at
+ * least that; newer ones at udmabuf0's size.  Either way the card can only
+ * wrap cleanly in a ring aligned to its size.
+ */
+static int pci_ring_setup(void) {
+	unsigned long long size, phys;
+	uint32_t rev = reg_rd(REG_CFG) & 0xff, base = reg_rd(REG_DMABASE), min;
+
+	if (sysfs_num(UDMABUF_SYSFS "size", &size) != 0 ||
+	  sysfs_num(UDMABUF_SYSFS "phys_addr", &phys) != 0)
+		return 3;
+	min = rev <= FPGA_FIXED_RING_REV ? DMA_RING_SIZE : DMA_RING_MIN;
+	if (rev <= FPGA_FIXED_RING_REV && size > DMA_RING_SIZE)
+		size = DMA_RING_SIZE;
+	if (size & (size - 1) || size < min || size > 0x80000000) {
+		fprintf(stderr, "udmabuf0: %llu bytes will not do for FPGA rev %u, "
+		  "need a power of two of at least %u\n", size, rev, min);
+		return 3;
+	}
+	if (phys & (size - 1) || phys != base) {
+		fprintf(stderr, "udmabuf0: at 0x%llx, FPGA DMA base is 0x%08x; "
+		  "needs tsmini2_init and %llu byte alignment\n", phys, base, size);
+		return 3;
+	}
+	ring.size = size;
+	ring.mask = size - 1;
+	return 0;
+}
+
+/* udmabuf0 is mapped cacheable, and fpga_loop() hands each span it copies
+ * out between card and CPU with udmabuf's manual cache sync: an invalidate
+ * where DMA is not coherent, nothing where it is.  Opening it O_SYNC instead
+ * (--dma-uncached, or a udmabuf without sync) maps it uncached and every
+ * read of the ring goes all the way to DRAM.
+ */
+static int dma_uncached;
+static int sync_fd[4] = { -1, -1, -1, -1 }; /* offset, size, cpu, device */
+
+static void sysfs_put(int fd, uint32_t v) {
+	char b[16];
+
+	if (pwrite(fd, b, snprintf(b, sizeof(b), "%u", v), 0) == -1)
+		perror("udmabuf0 sync");
+}
+
+static int pci_sync_open(void) {
+	static const char *attr[] = { "sync_offset", "sync_size",
+	  "sync_for_cpu", "sync_for_device" };
+	char path[64];
+	int i, fd;
+
+	fd = open(UDMABUF_SYSFS "sync_direction", O_WRONLY);
+	if (fd == -1) return -1;
+	sysfs_put(fd, 2); /* DMA_FROM_DEVICE */
+	close(fd);
+	for (i = 0; i < 4; i++) {
+		snprintf(path, sizeof(path), UDMABUF_SYSFS "%s", attr[i]);
+		sync_fd[i] = open(path, O_WRONLY);
+		if (sync_fd[i] != -1) continue;
+		while (i--) close(sync_fd[i]);
+		sync_fd[0] = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void pci_sync_range(uint32_t off, uint32_t len, int cpu) {
+	static uint32_t soff = -1, slen;
+
+	if (off != soff) sysfs_put(sync_fd[0], soff = off);
+	if (len != slen) sysfs_put(sync_fd[1], slen = len);
+	sysfs_put(sync_fd[cpu ? 2 : 3], 1);
+}
+
+static void pci_sync(uint32_t off, uint32_t len, int cpu) {
+	uint32_t n = ring.size - off;
+
+	if (sync_fd[0] == -1) return;
+	if (len > n) {
+		pci_sync_range(off, n, cpu);
+		off = 0;
+		len -= n;
+	}
+	pci_sync_range(off, len, cpu);
+}
+
+static int pci_open_dma(void) {
+	int memfd, r;
+
+	r = pci_ring_setup();
+	if (r) return r;
+	if (!dma_uncached && pci_sync_open() != 0) {
+		fprintf(stderr, "udmabuf0: no manual cache sync, mapping it "
+		  "uncached\n");
+		dma_uncached = 1;
+	}
+	memfd = open("/dev/udmabuf0", O_RDWR | (dma_uncached ? O_SYNC : 0));
+	if (memfd == -1) {
+		perror("/dev/udmabuf0");
+		return 3;
+	}
+
+	dmabuf = map_twice(memfd, ring.size, 0);
+	assert (dmabuf != (void *)-1);
+	return 0;
+}
+
+static uint32_t pci_rd(uint32_t reg) {
+	return *(volatile uint32_t *)(fpga + reg);
+}
+
+static void pci_wr(uint32_t reg, uint32_t val) {
+	*(volatile uint32_t *)(fpga + reg) = val;
+}
+
+static struct backend pci_backend = {
+	"pci", pci_open_regs, pci_open_dma, pci_rd, pci_wr, pci_sync
+};
+
+/* --bench-dma: copy the whole ring out BENCH_BYTES over, in the spans
+ * fpga_loop() would take, from an uncached mapping and then from a cached
+ * one with the sync around each span.  The card may be writing to it
+ * meanwhile; that only costs the same as it would for real.
+ */
+#define BENCH_BYTES (64 << 20)
+
+static double bench_copy(uint8_t *p, uint8_t *to, uint32_t span, int sync) {
+	uint64_t t0, n;
+	uint32_t off;
+
+	/* Round the ring like fpga_loop(): p is mapped twice, spans may wrap */
+	t0 = now_ns(CLOCK_MONOTONIC);
+	for (n = 0, off = 0; n < BENCH_BYTES; n += span) {
+		if (sync) pci_sync(off, span, 1);
+		memcpy(to, p + off, span);
+		if (sync) pci_sync(off, span, 0);
+		off = ring_adv(off, span);
+	}
+	return n * 1e3 / (now_ns(CLOCK_MONOTONIC) - t0);
+}
+
+static int dma_bench(void) {
+	uint8_t *p[2], *to;
+	uint32_t span;
+	double mbs[2];
+	int fd, i, r;
+
+	if (dev != &pci_backend) {
+		fprintf(stderr, "--bench-dma needs --backend=pci\n");
+		return 3;
+	}
+	r = pci_ring_setup();
+	if (r) return r;
+	if (pci_sync_open() != 0) {
+		fprintf(stderr, "udmabuf0: no manual cache sync to compare\n");
+		return 3;
+	}
+	span = ring.size / 4 * 3 & ~4095; /* HARD_FIFO_TARGET */
+	to = malloc(span);
+	for (i = 0; i < 2; i++) {
+		fd = open("/dev/udmabuf0", O_RDWR | (i ? 0 : O_SYNC));
+		if (fd == -1) {
+			perror("/dev/udmabuf0");
+			return 3;
+		}
+		p[i] = map_twice(fd, ring.size, 0);
+		assert (p[i] != MAP_FAILED);
+		close(fd);
+	}
+	mbs[0] = bench_copy(p[0], to, span, 0);
+	mbs[1] = bench_copy(p[1], to, span, 1);
+	printf("uncached (O_SYNC): %.1f MB/s\n", mbs[0]);
+	printf("cached + sync:     %.1f MB/s, %.1fx\n", mbs[1], mbs[1] / mbs[0]);
+	printf("%u KB spans; %u MB/s takes %.1f%% of a CPU uncached, %.1f%% "
+	  "cached\n", span >> 10, SAMPLE_RATE * SAMPLE_BYTES / 1000000,
+	  SAMPLE_RATE * SAMPLE_BYTES / 1e4 / mbs[0],
+	  SAMPLE_RATE * SAMPLE_BYTES / 1e4 / mbs[1]);
+	return 0;
+}
+
+/* Simulated TS-MINI.  A producer thread plays the part of the FPGA: it
+ * writes a 4-channel pattern into a DMA ring in host memory and advances
+ * REG_DMAPTR at sim_mult * 5 MS/s.  SIGUSR1 raises the hard FIFO overflow
+ * bit; like the card, DMA then stops until REG_DMABASE is rewritten.
+ */
+#define SIM_DMA_PHYS 0x10000000
+#define SIM_TICK_NS 1000000
+
+enum { PAT_RAMP, PAT_SQUARE, PAT_ZERO };
+
+static _Atomic uint32_t sim_regs[0x20 / 4];
+static _Atomic int sim_overflow, sim_rearm;
+static uint32_t sim_mult = 1;
+static int sim_pattern[4] = { PAT_RAMP, PAT_RAMP, PAT_RAMP, PAT_RAMP };
+
+static int16_t sim_sample(uint64_t idx, int chan) {
+	switch (sim_pattern[chan]) {
+	case PAT_RAMP:
+		return (int16_t)(idx + chan * 0x4000);
+	case PAT_SQUARE:
+		return ((idx / 2500) & 1) ? 0x4000 : -0x4000; /* 1kHz */
+	default:
+		return 0;
+	}
+}
+
+static void sim_raise_overflow(int sig) {
+	sim_overflow = 1;
+}
+
+static void *sim_loop(void *x) {
+	struct timespec t0, next;
+	uint64_t idx = 0, due, ns = 0;
+	uint32_t w = 0, base;
+	int16_t *s;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	next = t0;
+	for (;;) {
+		ns += SIM_TICK_NS;
+		next.tv_nsec += SIM_TICK_NS;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		due = ns * sim_mult / (1000000000 / SAMPLE_RATE);
+
+		base = sim_regs[REG_DMABASE / 4];
+		if (atomic_load(&sim_rearm)) {
+			/* Only this thread moves REG_DMAPTR, so nothing undoes this */
+			sim_overflow = 0;
+			w = 0;
+			atomic_store(&sim_regs[REG_DMAPTR / 4], base);
+			atomic_store(&sim_rearm, 0);
+		}
+		if (sim_overflow) {
+			/* Hard FIFO overflowed; samples are lost until re-armed */
+			sim_regs[REG_DMAPTR / 4] = (base + w) | 1;
+			idx = due;
+			continue;
+		}
+
+		for (; idx < due; idx++) {
+			s = (int16_t *)(dmabuf + w);
+			s[0] = sim_sample(idx, 0);
+			s[1] = sim_sample(idx, 1);
+			s[2] = sim_sample(idx, 2);
+			s[3] = sim_sample(idx, 3);
+			w = ring_adv(w, SAMPLE_BYTES);
+		}
+		atomic_store_explicit(&sim_regs[REG_DMAPTR / 4], base + w,
+		  memory_order_release);
+	}
+
+	return NULL;
+}
+
+static int sim_open_regs(void) {
+	sim_regs[REG_CFG / 4] = 0x000fff03; /* rev 3, tsmini2_init defaults */
+	sim_regs[REG_DMABASE / 4] = SIM_DMA_PHYS;
+	sim_regs[REG_DMAPTR / 4] = SIM_DMA_PHYS;
+	sim_regs[REG_CN1 / 4] = 0xc0000fff;
+	return 0;
+}
+
+static int sim_open_dma(void) {
+	pthread_t tid;
+	int memfd;
+
+	memfd = memfd_create("tsmini2-sim-dma", 0);
+	assert (memfd != -1 && ftruncate(memfd, ring.size) == 0);
+	dmabuf = map_twice(memfd, ring.size, 0);
+	assert (dmabuf != (void *)-1);
+	signal(SIGUSR1, sim_raise_overflow);
+	pthread_create(&tid, NULL, sim_loop, NULL);
+	return 0;
+}
+
+static uint32_t sim_rd(uint32_t reg) {
+	if (reg >= sizeof(sim_regs)) return 0xffffffff;
+	return atomic_load_explicit(&sim_regs[reg / 4], memory_order_acquire);
+}
+
+static void sim_wr(uint32_t reg, uint32_t val) {
+	if (reg >= sizeof(sim_regs)) return;
+	if (reg == REG_CFG) val = (val & ~0xff) | 3; /* rev is read-only */
+	sim_regs[reg / 4] = val;
+	if (reg == REG_DMABASE && dmabuf) {
+		/* Restart at top of ring, overflow cleared.  Like a read after
+		 * the write on the real card, REG_DMAPTR says so once this returns.
+		 */
+		sim_rearm = 1;
+		while (atomic_load(&sim_rearm)) usleep(100);
+	}
+}
+
+static struct backend sim_backend = {
+	"sim", sim_open_regs, sim_open_dma, sim_rd, sim_wr, NULL
+};
+
+static int sim_parse_pattern(char *arg) {
+	static const char *names[] = { "ramp", "square", "zero" };
+	char *tok;
+	int i, n = 0, p;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		for (p = 0; p < 3; p++) if (strcmp(tok, names[p]) == 0) break;
+		if (p == 3 || n == 4) return -1;
+		sim_pattern[n++] = p;
+	}
+	if (n == 0) return -1;
+	for (i = n; i < 4; i++) sim_pattern[i] = sim_pattern[n - 1];
+	return 0;
+}
 
 static uint8_t read_spi_byte(void) {
   uint32_t n = 0;
   uint8_t ret;
   for (ret = n = 0; n < 8; n++) {
-    *(volatile uint32_t *)(fpga + 0x10) = reg10h & ~(1<<17); /* clk lo */
-    *(volatile uint32_t *)(fpga + 0x10) = reg10h | (1<<17); /* clk hi */
+    reg_wr(REG_CN1, reg10h & ~(1<<17)); /* clk lo */
+    reg_wr(REG_CN1, reg10h | (1<<17)); /* clk hi */
     ret = (ret << 1);
-    if (*(volatile uint32_t *)(fpga + 0x10) & (1<<19)) ret |= 1;
+    if (reg_rd(REG_CN1) & (1<<19)) ret |= 1;
   }
   return ret;
 }
@@ -73,8 +631,8 @@ static void write_spi_byte(uint8_t x) {
   uint32_t v;
   for (n = 0; n < 8; n++) {
     if (x & 0x80) v = reg10h | (1<<16); else v = reg10h & ~(1<<16);
-    *(volatile uint32_t *)(fpga + 0x10) = v & ~(1<<17); /* clk lo */
-    *(volatile uint32_t *)(fpga + 0x10) = v | (1<<17); /* clk hi */
+    reg_wr(REG_CN1, v & ~(1<<17)); /* clk lo */
+    reg_wr(REG_CN1, v | (1<<17)); /* clk hi */
     x = x << 1;
   }
   return;
@@ -82,12 +640,12 @@ static void write_spi_byte(uint8_t x) {
 
 static void enable_cs(void) {
   reg10h &= ~(1<<18);
-  *(volatile uint32_t *)(fpga + 0x10) = reg10h;
+  reg_wr(REG_CN1, reg10h);
 }
 
 static void disable_cs(void) {
   reg10h |= (1<<18);
-  *(volatile uint32_t *)(fpga + 0x10) = reg10h;
+  reg_wr(REG_CN1, reg10h);
 }
 
 static void spi_one_byte_cmd(uint8_t cmd) {
@@ -184,9 +742,9 @@ static int opt_save(char *arg) {
 	uint32_t id, fpgarev;
 	FILE *out = stdout;
 
-	fpgarev = *(volatile uint32_t *)(fpga) & 0xff;
+	fpgarev = reg_rd(REG_CFG) & 0xff;
 	assert(fpgarev >= 3);
-	reg10h = *(volatile uint32_t *)(fpga + 0x10);
+	reg10h = reg_rd(REG_CN1);
 	fpga_spif = (uint8_t *)malloc(0x200000);
 	assert(fpga_spif != NULL);
 
@@ -228,9 +786,9 @@ static int opt_program(char *arg) {
 	uint32_t id, fpgarev;
 	FILE *in = stdin;
 
-	fpgarev = *(volatile uint32_t *)(fpga) & 0xff;
+	fpgarev = reg_rd(REG_CFG) & 0xff;
 	assert(fpgarev >= 3);
-	reg10h = *(volatile uint32_t *)(fpga + 0x10);
+	reg10h = reg_rd(REG_CN1);
 	fpga_spif = (uint8_t *)malloc(0x200000);
 	assert(fpga_spif != NULL);
 	memset(fpga_spif, 0xff, 0x200000);
@@ -292,224 +850,3304 @@ void usage(char **argv) {
 	fprintf(stderr, "Usage: %s [OPTION] ...\n"
 	  "embeddedTS TS-MINI PCIe card manipulation.\n"
 	  "\n"
-	  "  -i, --initdma=PHYS       Initialize 2MB DMA buffer at physical address PHYS\n"
+	  "  -i, --initdma=PHYS       Initialize DMA ring buffer at physical address PHYS\n"
 	  "  -o, --initcn1=OUTPUTS    Initialize CN1 digital outputs to OUTPUTS\n"
 	  "  -c, --config=VAL         Initialize config reg to VAL\n"
 	  "  -p, --program=RPDFILE    Program new FPGA configuration flash from RPDFILE\n"
 	  "  -s, --save=RPDFILE       Save existing FPGA flash config to RPDFILE\n"
 	  "  -l, --info               Print revision and configuration\n"
+	  "      --backend=NAME       Use \"pci\" (default) or \"sim\" simulated card\n"
+	  "      --sim-rate=N         Simulate N times the real 5 MS/s sample rate\n"
+	  "      --sim-pattern=P,...  Per-channel sim pattern: ramp, square or zero\n"
+	  "      --dma-uncached       Map the DMA ring uncached (O_SYNC) instead of\n"
+	  "                           cached with explicit cache sync\n"
+	  "      --bench-dma          Compare copying out of the ring both ways\n"
+	  "      --channels=N,...     Keep only channels N (1, 2 or all 4 of them)\n"
+	  "                           in the FIFO and everything sent on\n"
+	  "      --minmax             Track each channel's range, shown by --stats\n"
+	  "      --crc                CRC32C the FIFO stream, shown by --stats\n"
+	  "      --pin=NAME:CPUS      Run producer (the DMA poll) or sink NAME on CPUS:\n"
+	  "                           a list like 2,4-5, isolated or node\n"
+	  "      --numa=NODE          Put the FIFO on NUMA NODE (default the card's,\n"
+	  "                           -1 for none)\n"
+	  "      --deadline[=PCT]     Poll DMA under SCHED_DEADLINE with PCT of each\n"
+	  "                           poll interval (default 10)\n"
+	  "      --zerocopy           vmsplice/splice samples when stdout is a pipe/socket\n"
+	  "      --fifo-size=BYTES    Soft FIFO size, K/M/G suffix allowed (default 512M)\n"
+	  "      --stats[=SECS]       Print DMA poll statistics every SECS and at exit\n"
+	  "      --low-latency[=CPU]  Forward 4KB blocks as they arrive, busy-polling on CPU\n"
+	  "      --output=FILE        Capture to FILE with io_uring and O_DIRECT,\n"
+	  "                           logging samples lost to FILE.gaps\n"
+	  "      --capture-dir=DIR    Capture to preallocated segment files in DIR,\n"
+	  "                           logging samples lost to DIR/tsmini2.gaps\n"
+	  "      --segment-size=BYTES Bytes per segment file (default 1G)\n"
+	  "      --segment-time=SECS  Seconds of samples per segment file instead\n"
+	  "      --stripe=DIR,DIR,... Stripe the capture round-robin over directories\n"
+	  "      --stripe-block=BYTES Stripe block size (default 1M)\n"
+	  "      --stripe-qd=N        Writes in flight per stripe (default 8)\n"
+	  "      --listen=PORT        Serve samples to one TCP client at a time on PORT\n"
+	  "      --framed             Use the resumable framed protocol on --listen,\n"
+	  "                           for tsmini2-fetch\n"
+	  "      --stdout             Also write samples to stdout next to other sinks\n"
+	  "      --lossy=SINK,...     Let stdout, listen or multicast fall behind and\n"
+	  "                           skip data instead of stalling the others\n"
+	  "      --shm=NAME           Publish the FIFO as POSIX shared memory NAME for\n"
+	  "                           tsmini2-shm.h readers\n"
+	  "      --multicast=GROUP:PORT\n"
+	  "                           Send samples as UDP datagrams to IPv4 multicast\n"
+	  "                           GROUP, for tsmini2-mcrecv\n"
+	  "      --multicast-if=ADDR  Send multicast from the interface with ADDR\n"
+	  "      --overflow=POLICY    When the FIFO fills: terminate (default),\n"
+	  "                           drop-newest or drop-oldest, and carry on;\n"
+	  "                           --stripe and --zerocopy stdout only ever\n"
+	  "                           drop newest\n"
+	  "      --spill=FILE         Let stdout, --listen and --multicast fall behind\n"
+	  "                           by up to a scratch FILE or device more than the\n"
+	  "                           FIFO, spilling the backlog there\n"
+	  "      --spill-size=BYTES   Scratch FILE size (default 16G, or the device)\n"
+	  "      --blocks[=SAMPLES]   Frame stdout as checksummed, timestamped blocks\n"
+	  "                           of up to SAMPLES (default 8192), for\n"
+	  "                           tsmini2-unblock\n"
+	  "      --shed[=SECS]        With --blocks, reduce the stream in stages when\n"
+	  "                           the FIFO would fill within SECS (default 10)\n"
+	  "      --shed-channels=N,...\n"
+	  "                           Channels kept from stage 2 on (default 1,2)\n"
+	  "      --shed-decimate=N    Samples averaged into one at stage 3 (default 4)\n"
 	  "\n"
 	  "By default, this program connects to the TS-MINI and sends 4x 16-bit channels\n" 
-          "of raw binary analog data at 5 megasample/sec.\n", argv[0]);
+          "of raw binary analog data at 5 megasample/sec.\n"
+	  "\n"
+	  "SIGINT or SIGTERM stops acquisition and flushes the FIFO before exiting.\n"
+	  "A hard FIFO overflow costs the samples missed while DMA is re-armed, not\n"
+	  "the run.  With --backend=sim, send SIGUSR1 to raise one.\n", argv[0]);
 }
 
 
 
-static void buf_put(uint8_t *b, uint32_t len) {
-	if (put + len <= BUFSIZE) memcpy(&buf[put], b, len);
-	else {
-		uint32_t n = BUFSIZE - put;
-		memcpy(&buf[put], b, n);
-		memcpy(buf, b + n, len - n);
+static long futex(_Atomic uint32_t *uaddr, int op, uint32_t val) {
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void fifo_wake(struct fifo *f) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&f->parked, memory_order_relaxed)) {
+		f->parked = 0;
+		futex(&f->parked, FUTEX_WAKE_PRIVATE, INT_MAX);
+		if (f->evfd != -1) eventfd_write(f->evfd, 1);
 	}
-	put += len;
-	if (put >= BUFSIZE) put -= BUFSIZE;
 }
 
-static void *fpga_loop(void *x) {
-	uint32_t cur, n;
-	struct sched_param sched;
-	uint32_t sleep = 1000;
+/* The DMA ring to FIFO copy.  Nothing reads the FIFO copy until a sink gets
+ * to it, often seconds later, so it is written with non-temporal stores
+ * that bypass the cache rather than evict what the sinks are working on.
+ * The SSE4.1 kernel reads with streaming loads (MOVNTDQA), which is what an
+ * uncached or write-combining ring wants; on cached memory they are plain
+ * loads.  --low-latency keeps memcpy(), its sinks read each block right
+ * away.  The kernels fence their stores, buf_put() publishes after.
+ */
+static void copy_plain(void *dst, const void *src, size_t len) {
+	memcpy(dst, src, len);
+}
 
-	/* Linux trick for improved realtime determinism: */
-	sched.sched_priority = 99;
-	pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void copy_nt_avx2(void *dst, const void *src, size_t len) {
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t n = -(uintptr_t)d & 31;
+	__m256i a, b, c, e;
 
-superloop:
-	pthread_mutex_lock(&buflock);
-	cur = *(volatile uint32_t *)(fpga + 8) - dmabuf_phys;
-	if (cur & 1) {
-		// Hard FIFO overflow; close stdout, we failed
-		nf = UINT32_MAX;
-		fprintf(stderr, "Linux realtime kernel bug detected!\n");
-	} else {
-		cur &= ~3;
-	
-		n = (cur - last) & 0x1fffff;
-		if (BUFSIZE - nf <= n) n = (BUFSIZE - nf - 1) & ~0x7f;
-	
-		if (last + n > 0x200000) {
-			uint32_t i = 0x200000 - last;
-			buf_put(dmabuf + last, i);
-			buf_put(dmabuf, n - i);
-		} else buf_put(dmabuf + last, n);
-	
-		last = (last + n) & 0x1fffff;
+	if (n > len) n = len;
+	memcpy(d, s, n);
+	d += n, s += n, len -= n;
+	for (; len >= 128; len -= 128, d += 128, s += 128) {
+		a = _mm256_loadu_si256((const __m256i *)s);
+		b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_stream_si256((__m256i *)d, a);
+		_mm256_stream_si256((__m256i *)(d + 32), b);
+		_mm256_stream_si256((__m256i *)(d + 64), c);
+		_mm256_stream_si256((__m256i *)(d + 96), e);
+	}
+	memcpy(d, s, len);
+	_mm_sfence();
+}
 
-		/* Wake up writer when FIFO moves from empty to not-empty */
-		if (nf == 0 && n > 0) pthread_cond_signal(&bufcond);
+__attribute__((target("sse4.1")))
+static void copy_nt_sse41(void *dst, const void *src, size_t len) {
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t n = -(uintptr_t)d & 15;
+	__m128i a, b, c, e;
+
+	if (n > len) n = len;
+	memcpy(d, s, n);
+	d += n, s += n, len -= n;
+	/* MOVNTDQA needs the source aligned too */
+	for (; ((uintptr_t)s & 15) == 0 && len >= 64; len -= 64, d += 64, s += 64) {
+		a = _mm_stream_load_si128((__m128i *)s);
+		b = _mm_stream_load_si128((__m128i *)(s + 16));
+		c = _mm_stream_load_si128((__m128i *)(s + 32));
+		e = _mm_stream_load_si128((__m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	for (; len >= 64; len -= 64, d += 64, s += 64) {
+		a = _mm_loadu_si128((const __m128i *)s);
+		b = _mm_loadu_si128((const __m128i *)(s + 16));
+		c = _mm_loadu_si128((const __m128i *)(s + 32));
+		e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	memcpy(d, s, len);
+	_mm_sfence();
+}
+#endif
 
-		nf += n;
+static void (*copy_fn)(void *, const void *, size_t) = copy_plain;
+static const char *copy_name = "memcpy";
 
-		/* Adaptive sleep attempts to wakeup when hard FIFO 3/4 full */
-		if (n < 0x180000) sleep += 1000; else sleep -= 1000;
-		if (sleep < 10000) sleep = 10000;
-		else if (sleep > MAX_LATENCY_US) sleep = MAX_LATENCY_US;
+/* Pick the copy for the ring's mapping, uncached says the ring is read
+ * uncached or write-combined
+ */
+static void copy_select(int uncached) {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (!uncached && __builtin_cpu_supports("avx2")) {
+		copy_fn = copy_nt_avx2;
+		copy_name = "avx2 nt stores";
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		copy_fn = copy_nt_sse41;
+		copy_name = "sse4.1 streaming loads, nt stores";
 	}
+#endif
+}
 
-	// Soft FIFO overflow; close stdout, we failed
-	if (nf >= BUFSIZE - 1 - 128) {
-		nf = UINT32_MAX;
-		pthread_mutex_unlock(&buflock);
-		return (void *)1;
-	} 
+/* --channels, --minmax and --crc: transforms fused into buf_put()'s single
+ * pass over the ring.  The ring is taken XF_CHUNK at a time, which then
+ * stays in L1 for each transform in turn: min/max per channel, compaction
+ * to the xf.keep channels, CRC32C of the result and last the copy into the
+ * FIFO, so the ring is read and the FIFO written once however many are on.
+ * The min/max and the running CRC go into the batch.
+ */
+#define XF_CHUNK 4096
+static struct {
+	uint32_t keep; /* Channels the FIFO carries, 0xf for all */
+	int minmax, crc, on;
+	uint32_t run;  /* CRC32C of the FIFO stream so far */
+} xf = { 0xf };
 
-	pthread_mutex_unlock(&buflock);
-	usleep(sleep);
-	goto superloop;
+static uint32_t (*xf_compact)(int16_t *out, const int16_t *in, uint32_t len);
 
-	return NULL;
+/* The FIFO bytes len bytes of the ring become */
+static inline uint64_t xf_bytes(uint64_t len) {
+	return xf.keep == 0xf ? len : len / SAMPLE_BYTES * fifo.sample_bytes;
 }
 
-int main(int argc, char **argv) {
-	ssize_t r;
-	uint32_t reg;
-	int fpgafd, memfd, c, regset = 0;
-	pthread_mutexattr_t mattr;
-	pthread_attr_t attr;
-	pthread_t tid;
-	fd_set wfds;
-	char *opt_save_arg = NULL;
-	char *opt_program_arg = NULL;
-	static struct option long_options[] = {
-	  { "program", 1, 0, 'p' },
-	  { "save", 1, 0, 's' },
-	  { "initdma", 1, 0, 'i' },
-	  { "initcn1", 1, 0, 'o' },
-	  { "config", 1, 0, 'c' },
-	  { "info", 0, 0, 'l' },
-	  { "help", 0, 0, 'h' },
-	  { 0, 0, 0, 0}
-	};
+static uint32_t compact_plain(int16_t *out, const int16_t *in, uint32_t len) {
+	uint32_t i, n = 0;
 
-	fpgafd = open("/tsmini2/resource0", O_RDWR|O_SYNC);
-	if (fpgafd == -1) {
-		perror("/tsmini2/resource0");
-		return 3;
-	}
+	for (i = 0; i < len / 2; i++)
+		if (xf.keep & 1 << (i & 3)) out[n++] = in[i];
+	return n * 2;
+}
 
-	fpga = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fpgafd, 0);
-	assert (fpga != (void *)-1);
+#if defined(__x86_64__)
+/* Two samples to a vector, lanes c and c + 4 are channel c */
+static void xf_minmax(const int16_t *in, uint32_t len, int16_t *lo,
+  int16_t *hi) {
+	__m128i mn = _mm_set1_epi16(INT16_MAX), mx = _mm_set1_epi16(INT16_MIN), v;
+	int16_t a[8], b[8];
+	uint32_t i, c;
 
-	while ((c = getopt_long(argc, argv, "c:o:i:s:p:lh", long_options, NULL)) != -1) {
-		switch(c) {
-		case 'c':
-			regset = 1;
-			*(volatile uint32_t *)(fpga) = strtoul(optarg, NULL, 0);
-			break;
-		case 'o':
-			regset = 1;
-			*(volatile uint32_t *)(fpga + 0x10) = strtoul(optarg, NULL, 0);
-			break;
-		case 'i':
-			regset = 1;
-			*(volatile uint32_t *)(fpga + 4) = strtoul(optarg, NULL, 0);
-			break;
-		case 's':
-			opt_save_arg = strdup(optarg);
-			break;
-		case 'p':
-			opt_program_arg = strdup(optarg);
-			break;
-		case 'l':
-			reg = *(volatile uint32_t *)(fpga);
-			printf("rev=%d\n", reg & 0xff);
-			printf("sel_an1_gnd=%d\n", !!(reg & (1 << 8)));
-			printf("sel_an2_gnd=%d\n", !!(reg & (1 << 9)));
-			printf("sel_an3_gnd=%d\n", !!(reg & (1 << 10)));
-			printf("sel_an4_gnd=%d\n", !!(reg & (1 << 11)));
-			printf("sel_an4_gnd=%d\n", !!(reg & (1 << 11)));
-			printf("sel_an3_dc=%d\n", !!(reg & (1 << 12)));
-			printf("sel_an4_dc=%d\n", !!(reg & (1 << 13)));
-			return 0;
-		case 'h':
-		default:
-			usage(argv);
-			return 0;
-		}
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)((const uint8_t *)in + i));
+		mn = _mm_min_epi16(mn, v);
+		mx = _mm_max_epi16(mx, v);
 	}
-
-	if (opt_save_arg) return opt_save(opt_save_arg);
-	else if (opt_program_arg) return opt_program(opt_program_arg);
-	else if (regset) return 0;
-
-	memfd = open("/dev/udmabuf0", O_RDWR | O_SYNC);
-	if (memfd == -1) {
-		perror("/dev/udmabuf0");
-		return 3;
+	_mm_storeu_si128((__m128i *)a, mn);
+	_mm_storeu_si128((__m128i *)b, mx);
+	for (c = 0; c < 8; c++) {
+		if (a[c] < lo[c & 3]) lo[c & 3] = a[c];
+		if (b[c] > hi[c & 3]) hi[c & 3] = b[c];
+	}
+	for (i /= 2; i < len / 2; i++) {
+		if (in[i] < lo[i & 3]) lo[i & 3] = in[i];
+		if (in[i] > hi[i & 3]) hi[i & 3] = in[i];
 	}
+}
 
-	dmabuf = mmap(0, 0x200000, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
-	assert (dmabuf != (void *)-1);
+/* One PSHUFB per two samples; out needs 16 bytes of slack */
+__attribute__((target("ssse3")))
+static uint32_t compact_ssse3(int16_t *out, const int16_t *in, uint32_t len) {
+	uint8_t m[16], *o = (uint8_t *)out;
+	uint32_t i, c, w = 0;
+	__m128i mask;
 
-	buf = (uint8_t *)malloc(BUFSIZE);
-	if (buf == NULL) {
-		fprintf(stderr, "%s: Memory allocation failed\n", argv[0]);
-		return 3;
+	memset(m, 0x80, sizeof(m));
+	for (i = 0; i < 2; i++)
+		for (c = 0; c < 4; c++)
+			if (xf.keep & 1 << c) {
+				m[w++] = i * 8 + c * 2;
+				m[w++] = i * 8 + c * 2 + 1;
+			}
+	mask = _mm_loadu_si128((const __m128i *)m);
+	for (i = 0; i + 16 <= len; i += 16, o += w)
+		_mm_storeu_si128((__m128i *)o, _mm_shuffle_epi8(_mm_loadu_si128(
+		  (const __m128i *)((const uint8_t *)in + i)), mask));
+	return o - (uint8_t *)out + compact_plain((int16_t *)o,
+	  (const int16_t *)((const uint8_t *)in + i), len - i);
+}
+#else
+static void xf_minmax(const int16_t *in, uint32_t len, int16_t *lo,
+  int16_t *hi) {
+	uint32_t i;
+
+	for (i = 0; i < len / 2; i++) {
+		if (in[i] < lo[i & 3]) lo[i & 3] = in[i];
+		if (in[i] > hi[i & 3]) hi[i & 3] = in[i];
 	}
-	nf = put = get = 0;
+}
+#endif
 
-	/* Linux trick for improved realtime determinism: */
-	mlockall(MCL_CURRENT|MCL_FUTURE);
-	memset(buf, 0, BUFSIZE);
+static void xf_select(void) {
+	xf.on = xf.keep != 0xf || xf.minmax || xf.crc;
+	xf_compact = compact_plain;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) xf_compact = compact_ssse3;
+#endif
+}
 
-	dmabuf_phys = *(uint32_t *)(fpga + 4);
-	last = *(uint32_t *)(fpga + 8) - dmabuf_phys;
-	last &= ~3;
+/* len is whole samples; returns the bytes put at dst */
+static uint32_t xf_put(uint8_t *dst, const uint8_t *src, uint32_t len,
+  struct batch *bt) {
+	static _Alignas(64) int16_t stage[XF_CHUNK / 2 + 8];
+	const uint8_t *p;
+	uint32_t n, m, out = 0;
+	int c;
+
+	for (c = 0; c < 4; c++) {
+		bt->min[c] = INT16_MAX;
+		bt->max[c] = INT16_MIN;
+	}
+	for (; len; len -= n, src += n) {
+		n = len < XF_CHUNK ? len : XF_CHUNK;
+		if (xf.minmax)
+			xf_minmax((const int16_t *)src, n, bt->min, bt->max);
+		p = src;
+		m = n;
+		if (xf.keep != 0xf) {
+			m = xf_compact(stage, (const int16_t *)src, n);
+			p = (const uint8_t *)stage;
+		}
+		if (xf.crc) xf.run = tsmini2_crc32c(xf.run, p, m);
+		copy_fn(dst + out, p, m);
+		out += m;
+	}
+	bt->crc = xf.run;
+	return out;
+}
+
+/* Producer side: publish len bytes copied at put, or stop the FIFO */
+static void buf_put(uint8_t *b, uint32_t len, uint64_t mono) {
+	uint64_t put = atomic_load_explicit(&fifo.put, memory_order_relaxed);
+	uint64_t nb = atomic_load_explicit(&fifo.nbatch, memory_order_relaxed);
+	struct batch *bt = &fifo.batch[nb % NBATCH];
+
+	if (xf.on) len = xf_put(&fifo.buf[put % fifo.size], b, len, bt);
+	else copy_fn(&fifo.buf[put % fifo.size], b, len);
+	bt->end = put + len;
+	bt->mono = mono;
+	atomic_store_explicit(&fifo.nbatch, nb + 1, memory_order_release);
+	atomic_store_explicit(&fifo.put, put + len, memory_order_release);
+	if (fifo.shm)
+		atomic_store_explicit(&fifo.shm->put, put + len, memory_order_release);
+}
+
+/* Consumer side: find the batch holding pos, *k is the caller's search hint.
+ * Returns NULL if the producer has already recycled that log entry.
+ */
+static struct batch *fifo_batch(struct fifo *f, uint64_t pos, uint64_t *k) {
+	uint64_t nb = atomic_load_explicit(&f->nbatch, memory_order_acquire);
+	struct batch *bt = NULL;
+
+	if (nb - *k > NBATCH - 1) *k = nb - (NBATCH - 1);
+	for (; *k < nb; (*k)++) {
+		bt = &f->batch[*k % NBATCH];
+		if (bt->end > pos) break;
+	}
+	if (*k == nb) return NULL;
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&f->nbatch, memory_order_relaxed) - *k >= NBATCH)
+		return NULL;
+	return bt;
+}
+
+static void gap_put(struct fifo *f, uint64_t pos, uint64_t lost) {
+	uint64_t ng = atomic_load_explicit(&f->ngap, memory_order_relaxed);
+	struct gap *g = &f->gap[ng % NGAP];
+	struct tsmini2_shm_gap *sg;
+
+	g->pos = pos;
+	g->lost = lost;
+	g->total = (ng ? f->gap[(ng - 1) % NGAP].total : 0) + lost;
+	atomic_store_explicit(&f->ngap, ng + 1, memory_order_release);
+	if (f->shm) {
+		/* Same log for tsmini2-shm.h readers, ahead of the data after it */
+		sg = &f->shm->gap[ng % TSMINI2_SHM_GAPS];
+		sg->pos = g->pos;
+		sg->lost = g->lost;
+		sg->total = g->total;
+		atomic_store_explicit(&f->shm->ngap, ng + 1, memory_order_release);
+	}
+}
+
+/* Copy out gap k, 0 if the producer has recycled it */
+static int gap_get(struct fifo *f, uint64_t k, struct gap *g) {
+	*g = f->gap[k % NGAP];
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&f->ngap, memory_order_relaxed) - k <= NGAP;
+}
+
+/* Index of the sample at FIFO position pos, counting the lost ones */
+static uint64_t pos_sample(struct fifo *f, uint64_t pos) {
+	uint64_t ng = atomic_load_explicit(&f->ngap, memory_order_acquire), k;
+	struct gap g = { 0, 0, 0 };
+
+	for (k = ng; k > 0 && ng - k < NGAP; k--)
+		if (gap_get(f, k - 1, &g) && g.pos <= pos)
+			return pos / f->sample_bytes + g.total;
+	/* Older than the log: everything it still has came later */
+	return pos / f->sample_bytes + g.total - g.lost;
+}
+
+/* FIFO position of sample, or of the data after it if it was lost */
+static uint64_t sample_pos(struct fifo *f, uint64_t sample) {
+	uint64_t ng = atomic_load_explicit(&f->ngap, memory_order_acquire), k;
+	struct gap g = { 0, 0, 0 };
+
+	for (k = ng; k > 0 && ng - k < NGAP; k--) {
+		if (!gap_get(f, k - 1, &g)) continue;
+		if (sample >= g.pos / f->sample_bytes + g.total)
+			return (sample - g.total) * f->sample_bytes;
+		if (sample >= g.pos / f->sample_bytes + g.total - g.lost) return g.pos;
+	}
+	if (sample < g.total - g.lost) return 0;
+	return (sample - (g.total - g.lost)) * f->sample_bytes;
+}
+
+static void fifo_stop(struct fifo *f, int status) {
+	if (f->shm) f->shm->done = status + 1;
+	f->done = status + 1;
+	fifo_wake(f);
+}
+
+/* Consumer side: wait until data is available or the producer stopped */
+static uint64_t fifo_wait(struct fifo *f, uint64_t get) {
+	uint64_t put;
+
+	for (;;) {
+		put = atomic_load_explicit(&f->put, memory_order_acquire);
+		if (put != get || f->done) return put - get;
+		f->parked = 1;
+		put = atomic_load(&f->put);
+		if (put != get || f->done) return put - get;
+		futex(&f->parked, FUTEX_WAIT_PRIVATE, 1);
+	}
+}
+
+/* For consumers sleeping in epoll on f->evfd: returns nonzero if there is
+ * something to do at get already, else asks the producer for a wakeup.
+ */
+static int fifo_arm(struct fifo *f, uint64_t get) {
+	if (atomic_load_explicit(&f->put, memory_order_acquire) != get || f->done)
+		return 1;
+	f->parked = 1;
+	return atomic_load(&f->put) != get || f->done;
+}
+
+/* Every sink reads the FIFO through its own cursor and runs in its own
+ * thread.  The producer reuses space only once every non-lossy cursor is past
+ * it.  Lossy sinks (a live monitor, say) never hold it back; they read
+ * through a bounce buffer and skip ahead to the newest data when the
+ * producer is about to lap them.
+ */
+#define MAX_SINKS 8
+#define LOSSY_LAG (fifo.size - 2 * ring.size)
+
+struct sink {
+	const char *name;
+	int (*run)(struct sink *s);
+	int lossy, status;
+	pthread_t tid;
+	uint8_t *bounce;          /* MAX_WRITE bytes, lossy or spill sinks */
+	int spill;                /* Reads back what --spill put on disk */
+	_Atomic uint64_t skipped; /* Bytes the sink never passed on */
+	_Atomic uint64_t kgap;    /* Next producer gap to pass on */
+	uint64_t kgap_total;      /* Samples lost up to the last one passed on */
+	_Atomic uint64_t skip_to; /* --overflow=drop-oldest: give up data before */
+	int noskip;               /* Can not give it up, see sink_skip() */
+	FILE *gaplog;             /* --output sidecar, see gap_log() */
+	uint64_t gaplost;         /* Samples it has logged as lost */
+	_Alignas(64) _Atomic uint64_t get;
+};
+static struct sink sinks[MAX_SINKS];
+static int nsinks;
+static _Atomic int nstrict; /* Non-lossy sinks still running */
+
+/* The next producer gap at or before pos this sink has not passed on */
+static int sink_gap(struct sink *s, uint64_t pos, struct gap *g) {
+	uint64_t k = atomic_load(&s->kgap), ng;
+
+	for (;;) {
+		ng = atomic_load_explicit(&fifo.ngap, memory_order_acquire);
+		if (k == ng) return 0;
+		if (ng - k > NGAP) {
+			/* Missed some, they count towards the next one */
+			k = ng - NGAP;
+			continue;
+		}
+		if (!gap_get(&fifo, k, g)) continue;
+		if (g->pos > pos) return 0;
+		g->lost = g->total - s->kgap_total;
+		s->kgap_total = g->total;
+		atomic_store(&s->kgap, k + 1);
+		return 1;
+	}
+}
+
+/* How much of n bytes at pos comes before the next producer gap */
+static uint64_t sink_clip(struct sink *s, uint64_t pos, uint64_t n) {
+	uint64_t ng = atomic_load_explicit(&fifo.ngap, memory_order_acquire), k;
+	struct gap g;
+
+	for (k = ng; k > 0 && ng - k < NGAP; k--) {
+		if (!gap_get(&fifo, k - 1, &g) || g.pos <= pos) break;
+		if (g.pos < pos + n) n = g.pos - pos;
+	}
+	return n;
+}
+
+/* A raw capture can not carry its gaps in band, so --output and
+ * --capture-dir log them to a sidecar file instead: a line per gap with the
+ * index of the first sample lost, how many were and how many the capture
+ * is missing so far.  Sample index minus that total is where the next
+ * sample is in the capture.
+ */
+static void gap_log(struct sink *s, uint64_t sample, uint64_t lost) {
+	if (s->gaplog == NULL) return;
+	s->gaplost += lost;
+	fprintf(s->gaplog, "%llu %llu %llu\n", (unsigned long long)sample,
+	  (unsigned long long)lost, (unsigned long long)s->gaplost);
+	fflush(s->gaplog);
+}
+
+static void gap_report(struct sink *s, struct gap *g) {
+	uint64_t sample = g->pos / fifo.sample_bytes + g->total - g->lost;
+
+	fprintf(stderr, "%s: %llu samples lost at sample %llu\n",
+	  s->name, (unsigned long long)g->lost, (unsigned long long)sample);
+	gap_log(s, sample, g->lost);
+}
+
+/* --overflow=drop-oldest: jump over the backlog the producer wants back.
+ * Sinks call this where they can skip data they have not handed on yet.
+ * --stripe (blocks are spread over files by FIFO position) and zero-copy
+ * stdout (the pipe holds FIFO pages) can not, so they are marked noskip and
+ * never asked; while they hold the FIFO back it drops new data instead.
+ */
+static uint64_t sink_skip(struct sink *s, uint64_t pos) {
+	uint64_t to = atomic_load_explicit(&s->skip_to, memory_order_acquire);
+	struct gap g;
+
+	if (to <= pos) return pos;
+	/* Producer gaps inside what is skipped are part of this one */
+	while (sink_gap(s, to, &g));
+	fprintf(stderr, "%s: FIFO full, %llu samples dropped at sample %llu\n",
+	  s->name, (unsigned long long)(pos_sample(&fifo, to) -
+	  pos_sample(&fifo, pos)), (unsigned long long)pos_sample(&fifo, pos));
+	gap_log(s, pos_sample(&fifo, pos), pos_sample(&fifo, to) -
+	  pos_sample(&fifo, pos));
+	s->skipped += to - pos;
+	return to;
+}
+
+/* --spill: when the sinks that can read back from disk fall more than
+ * spill.hwm behind, spill_loop() copies the FIFO on ahead of them to a
+ * scratch file, used as a ring of spill.size bytes.  Everything from the
+ * oldest of their cursors up to spill.hi is then on disk, so their FIFO space
+ * can be reused.  Like lossy sinks they always read through their bounce
+ * buffer, from disk below spill.hi, so none of them ever holds FIFO space
+ * below it, even when stuck in a write.
+ */
+static struct {
+	char *path;
+	uint64_t size, hwm;
+	int rfd;                    /* Buffered, for reading back */
+	_Atomic uint64_t hi;
+	_Atomic uint64_t written, peak; /* Bytes, for --stats */
+} spill = { .rfd = -1 };
+
+/* Up to where the FIFO can be reused, as far as the sinks are concerned */
+static void fifo_release(void) {
+	uint64_t min = UINT64_MAX, p, get, hi = atomic_load(&spill.hi);
+	int i;
+
+	for (i = 0; i < nsinks; i++) {
+		if (sinks[i].lossy) continue;
+		p = atomic_load_explicit(&sinks[i].get, memory_order_acquire);
+		if (sinks[i].spill && p < hi) p = hi;
+		if (p < min) min = p;
+	}
+	p = atomic_load_explicit(&fifo.put, memory_order_acquire);
+	if (min > p) min = p;
+	get = atomic_load_explicit(&fifo.get, memory_order_relaxed);
+	while (min > get && !atomic_compare_exchange_weak(&fifo.get, &get, min));
+}
+
+static void sink_release(struct sink *s, uint64_t pos) {
+	struct gap g;
+
+	atomic_store_explicit(&s->get, pos, memory_order_release);
+	/* Plain byte streams can only say so on stderr */
+	while (pos != UINT64_MAX && sink_gap(s, pos, &g)) gap_report(s, &g);
+	if (!s->lossy) fifo_release();
+}
+
+/* A copy of the data at *pos for a spill sink, read back from disk if it is
+ * there, with *len cut down to what is in one piece.  NULL if the read failed
+ * and *pos was moved past what is lost.
+ */
+static uint8_t *spill_read(struct sink *s, uint64_t *pos, uint64_t *len) {
+	uint64_t hi, off = *pos % spill.size, n = 0;
+	ssize_t r;
+
+	while ((hi = atomic_load(&spill.hi)) <= *pos) {
+		memcpy(s->bounce, &fifo.buf[*pos % fifo.size], *len);
+		/* Unless it was spilled and the FIFO space reused meanwhile */
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load(&spill.hi) <= *pos) return s->bounce;
+	}
+	if (*len > hi - *pos) *len = hi - *pos;
+	if (*len > spill.size - off) *len = spill.size - off;
+	for (; n < *len; n += r) {
+		r = pread(spill.rfd, s->bounce + n, *len - n, off + n);
+		if (r == -1 && errno == EINTR) r = 0;
+		else if (r <= 0) {
+			fprintf(stderr, "%s: %s: %s, %llu bytes lost\n", s->name,
+			  spill.path, r ? strerror(errno) : "short read",
+			  (unsigned long long)(hi - *pos));
+			s->skipped += hi - *pos;
+			*pos = hi;
+			sink_release(s, hi);
+			return NULL;
+		}
+	}
+	posix_fadvise(spill.rfd, off, *len, POSIX_FADV_DONTNEED);
+	return s->bounce;
+}
+
+/* Where a sink finds *len bytes at *pos.  Lossy sinks get a copy, or NULL
+ * with *pos moved up to the newest data if they fell too far behind.  Spill
+ * sinks may get less than *len, read back from disk.
+ */
+static uint8_t *sink_read(struct sink *s, uint64_t *pos, uint64_t *len) {
+	uint64_t put;
+
+	if (s->spill) return spill_read(s, pos, len);
+	if (!s->lossy) return &fifo.buf[*pos % fifo.size];
+	put = atomic_load_explicit(&fifo.put, memory_order_acquire);
+	if (put - *pos <= LOSSY_LAG) {
+		memcpy(s->bounce, &fifo.buf[*pos % fifo.size], *len);
+		/* buf_put() may be writing up to a DMA ring past put */
+		atomic_thread_fence(memory_order_acquire);
+		put = atomic_load_explicit(&fifo.put, memory_order_relaxed);
+		if (put - *pos < fifo.size - ring.size) return s->bounce;
+	}
+	s->skipped += put - *pos;
+	*pos = put;
+	atomic_store_explicit(&s->get, put, memory_order_release);
+	return NULL;
+}
+
+/* --pin=NAME:CPUS puts fpga_loop() ("producer") or a sink's thread on CPUS,
+ * a list like 2,4-5, "isolated" for the kernel's isolcpus= set or "node"
+ * for the CPUs of the FIFO's NUMA node.  Names are checked and CPUS worked
+ * out once the sinks and the node are known, by pin_resolve().
+ */
+static struct pin {
+	const char *name;
+	char *cpus;
+	cpu_set_t set;
+} pins[MAX_SINKS + 1];
+static int npins;
+
+/* NUMA node the FIFO is placed on: the card's (NUMA_CARD), from sysfs,
+ * unless --numa says otherwise; -1 leaves it to the kernel.
+ */
+#define NUMA_CARD -2
+static int numa_node = NUMA_CARD;
+
+static int cpulist_parse(const char *list, cpu_set_t *set) {
+	unsigned long a, b;
+	char *end;
+
+	CPU_ZERO(set);
+	if (*list == '\0' || *list == '\n') return 0;
+	do {
+		a = b = strtoul(list, &end, 10);
+		if (end == list) return -1;
+		if (*end == '-') b = strtoul(end + 1, &end, 10);
+		if (b < a || b >= CPU_SETSIZE) return -1;
+		for (; a <= b; a++) CPU_SET(a, set);
+		list = end + 1;
+	} while (*end == ',');
+	return *end == '\0' || *end == '\n' ? 0 : -1;
+}
+
+/* A sysfs cpulist, as the kernel writes them */
+static int cpulist_read(const char *path, cpu_set_t *set) {
+	char buf[4096];
+	FILE *f = fopen(path, "r");
+	int r = -1;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (fgets(buf, sizeof(buf), f)) r = cpulist_parse(buf, set);
+	fclose(f);
+	if (r) fprintf(stderr, "%s: not a CPU list\n", path);
+	return r;
+}
+
+static int pin_add(char *arg) {
+	char *cpus = strchr(arg, ':');
+
+	if (cpus == NULL || npins == MAX_SINKS + 1) return -1;
+	*cpus++ = '\0';
+	pins[npins].name = arg;
+	pins[npins++].cpus = cpus;
+	return 0;
+}
+
+static int pin_resolve(void) {
+	char path[64];
+	struct pin *pn;
+	int i;
+
+	for (pn = pins; pn < pins + npins; pn++) {
+		for (i = 0; i < nsinks && strcmp(sinks[i].name, pn->name); i++);
+		if (strcmp(pn->name, "producer") != 0 && i == nsinks) {
+			fprintf(stderr, "--pin: %s is not producer or a sink in use\n",
+			  pn->name);
+			return -1;
+		}
+		if (strcmp(pn->cpus, "isolated") == 0) {
+			if (cpulist_read("/sys/devices/system/cpu/isolated", &pn->set))
+				return -1;
+		} else if (strcmp(pn->cpus, "node") == 0) {
+			if (numa_node < 0) {
+				fprintf(stderr, "--pin: the FIFO is on no NUMA node\n");
+				return -1;
+			}
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/"
+			  "cpulist", numa_node);
+			if (cpulist_read(path, &pn->set)) return -1;
+		} else if (cpulist_parse(pn->cpus, &pn->set)) {
+			fprintf(stderr, "--pin: bad CPU list %s\n", pn->cpus);
+			return -1;
+		}
+		if (CPU_COUNT(&pn->set) == 0) {
+			fprintf(stderr, "--pin: no CPUs for %s\n", pn->name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Pin the calling thread if --pin named it, 1 if it did */
+static int pin_self(const char *name) {
+	struct pin *pn;
+
+	for (pn = pins; pn < pins + npins; pn++) {
+		if (strcmp(pn->name, name) != 0) continue;
+		if (pthread_setaffinity_np(pthread_self(), sizeof(pn->set), &pn->set))
+			fprintf(stderr, "Can not pin %s to CPUs %s\n", name, pn->cpus);
+		return 1;
+	}
+	return 0;
+}
+
+/* The NUMA node of the card's PCIe root port, -1 if none or unknown */
+static int card_node(void) {
+	FILE *f = fopen("/tsmini2/numa_node", "r");
+	int node = -1;
+
+	if (f == NULL) return -1;
+	if (fscanf(f, "%d", &node) != 1) node = -1;
+	fclose(f);
+	return node;
+}
+
+/* Prefer numa_node for the FIFO's pages; the kernel falls back to other
+ * nodes rather than fail the allocation when it is short.  Must come before
+ * the pages are faulted in.  mbind() directly, to not need libnuma.
+ */
+static void numa_place(void *p, uint64_t len) {
+	unsigned long mask[1024 / (8 * sizeof(long))] = { 0 };
+
+	if (numa_node < 0) return;
+	if (numa_node >= 1023) {
+		fprintf(stderr, "NUMA node %d out of range\n", numa_node);
+		numa_node = -1;
+		return;
+	}
+	mask[numa_node / (8 * sizeof(long))] = 1UL << numa_node % (8 * sizeof(long));
+	if (syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, 8 * sizeof(mask), 0)) {
+		fprintf(stderr, "Can not place the FIFO on NUMA node %d: %s\n",
+		  numa_node, strerror(errno));
+		numa_node = -1;
+	}
+}
+
+/* --deadline[=PCT]: run fpga_loop() under SCHED_DEADLINE rather than
+ * SCHED_FIFO, reserving PCT of each poll interval at the nominal rate for
+ * it.  The kernel then admits it only if that fits, and throttles it rather
+ * than let it starve the sinks if it ever runs away.
+ */
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+struct dl_attr {
+	uint32_t size, policy;
+	uint64_t flags;
+	int32_t nice;
+	uint32_t priority;
+	uint64_t runtime, deadline, period;
+};
+static int dl_pct;
+
+static int dl_setup(double interval) {
+	struct dl_attr a;
+
+	memset(&a, 0, sizeof(a));
+	a.size = sizeof(a);
+	a.policy = SCHED_DEADLINE;
+	a.period = a.deadline = interval;
+	a.runtime = a.period / 100 * dl_pct;
+	if (syscall(SYS_sched_setattr, 0, &a, 0) == 0) {
+		fprintf(stderr, "DMA poll: SCHED_DEADLINE %lluus every %lluus\n",
+		  (unsigned long long)a.runtime / 1000,
+		  (unsigned long long)a.period / 1000);
+		return 0;
+	}
+	fprintf(stderr, "SCHED_DEADLINE refused (%s), using SCHED_FIFO\n",
+	  strerror(errno));
+	return -1;
+}
+
+static void *sink_loop(void *x) {
+	struct sink *s = x;
+
+	pin_self(s->name);
+	s->status = s->run(s);
+	if (!s->lossy) {
+		/* Gone, for good or bad; don't let it hold the FIFO back */
+		atomic_store(&s->get, UINT64_MAX);
+		if (--nstrict) sink_release(s, UINT64_MAX);
+	}
+	return NULL;
+}
+
+static struct sink *sink_add(const char *name, int (*run)(struct sink *)) {
+	struct sink *s = &sinks[nsinks++];
+
+	s->name = name;
+	s->run = run;
+	return s;
+}
+
+static struct sink *sink_find(const char *name) {
+	int i;
+
+	for (i = 0; i < nsinks; i++)
+		if (strcmp(sinks[i].name, name) == 0) return &sinks[i];
+	return NULL;
+}
+
+/* Parse a byte count with an optional K, M or G suffix, 0 if it is not one */
+static uint64_t parse_size(const char *arg) {
+	char *end;
+	uint64_t v = strtoull(arg, &end, 0);
+
+	if (end == arg) return 0;
+	switch (toupper(*end)) {
+	case 'G': v <<= 10;
+	case 'M': v <<= 10;
+	case 'K': v <<= 10;
+		end++;
+	}
+	return *end == '\0' ? v : 0;
+}
+
+struct prefault {
+	uint8_t *p;
+	uint64_t len, step;
+};
+
+static void *prefault_loop(void *x) {
+	struct prefault *pf = x;
+	uint64_t i;
+
+	for (i = 0; i < pf->len; i += pf->step) pf->p[i] = 0;
+	return NULL;
+}
+
+static char *shm_name;
+
+/* Back the FIFO with a memfd, using 1GB or 2MB hugepages when the pool has
+ * them and normal (THP eligible) pages otherwise, or for --shm with the
+ * POSIX shared memory object shm_name after a tsmini2-shm.h header.  It is
+ * mapped twice back to back so neither side ever has to split a copy at the
+ * wrap point.
+ * The pages are faulted in by one thread per CPU instead of a single memset,
+ * so mlockall() afterwards has little to do; with a NUMA node, by that
+ * node's CPUs.
+ */
+static int fifo_alloc(struct fifo *f, uint64_t size) {
+	static const struct { int flags; uint64_t page; const char *name; } hp[] = {
+	  { MFD_HUGETLB | (30 << MAP_HUGE_SHIFT), 1 << 30, "1GB hugepages" },
+	  { MFD_HUGETLB | (21 << MAP_HUGE_SHIFT), 1 << 21, "2MB hugepages" },
+	  { 0, 4096, "4KB pages" },
+	};
+	struct prefault pf[16];
+	pthread_t tid[16];
+	pthread_attr_t attr;
+	cpu_set_t node_cpus;
+	char path[64];
+	struct rlimit rl;
+	uint64_t chunk;
+	long i, n, ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	void *p = MAP_FAILED;
+	int fd;
+
+	if (shm_name) {
+		/* tmpfs, so no hugetlb; THP if shmem_enabled allows */
+		n = 2;
+		fd = shm_open(shm_name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if (fd == -1 || ftruncate(fd, TSMINI2_SHM_HDR + size) != 0) {
+			perror(shm_name);
+			return -1;
+		}
+		f->shm = mmap(0, TSMINI2_SHM_HDR, PROT_READ|PROT_WRITE, MAP_SHARED,
+		  fd, 0);
+		if (f->shm != MAP_FAILED) p = map_twice(fd, size, TSMINI2_SHM_HDR);
+		close(fd);
+		if (f->shm == MAP_FAILED || p == MAP_FAILED) {
+			shm_unlink(shm_name);
+			return -1;
+		}
+		f->shm->version = TSMINI2_SHM_VERSION;
+		f->shm->sample_bytes = f->sample_bytes;
+		f->shm->size = size;
+		f->shm->slack = ring.size;
+		assert(sizeof(*f->shm) <= TSMINI2_SHM_HDR);
+		f->shm->rate = SAMPLE_RATE * f->sample_bytes *
+		  (dev == &sim_backend ? sim_mult : 1);
+		memcpy(f->shm->magic, TSMINI2_SHM_MAGIC, 8);
+	} else for (n = 0; n < 3; n++) {
+		if (size % hp[n].page) continue;
+		fd = memfd_create("tsmini2-fifo", hp[n].flags);
+		if (fd == -1) continue;
+		if (ftruncate(fd, size) == 0) p = map_twice(fd, size, 0);
+		close(fd);
+		if (p != MAP_FAILED) break;
+	}
+	if (p == MAP_FAILED) return -1;
+	if (hp[n].page == 4096) madvise(p, size, MADV_HUGEPAGE);
+	f->buf = p;
+	f->size = size;
+	f->evfd = -1;
+
+	numa_place(p, size);
+	pthread_attr_init(&attr);
+	if (numa_node >= 0) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		  numa_node);
+		if (cpulist_read(path, &node_cpus) == 0) {
+			pthread_attr_setaffinity_np(&attr, sizeof(node_cpus), &node_cpus);
+			ncpu = CPU_COUNT(&node_cpus);
+		}
+	}
+	if (ncpu > 16) ncpu = 16;
+	if (ncpu <= 1) {
+		/* One CPU gains nothing from parallel faulting, let the kernel */
+		madvise(p, size, MADV_POPULATE_WRITE);
+	} else {
+		chunk = (size / ncpu + hp[n].page - 1) / hp[n].page * hp[n].page;
+		for (i = 0; i < ncpu; i++) {
+			pf[i].p = f->buf + i * chunk;
+			pf[i].len = i * chunk >= size ? 0 :
+			  (size - i * chunk < chunk ? size - i * chunk : chunk);
+			pf[i].step = hp[n].page;
+			pthread_create(&tid[i], &attr, prefault_loop, &pf[i]);
+		}
+		for (i = 0; i < ncpu; i++) pthread_join(tid[i], NULL);
+	}
+	pthread_attr_destroy(&attr);
+
+	getrlimit(RLIMIT_MEMLOCK, &rl);
+	fprintf(stderr, "FIFO: %llu MB in %s%s%s, ", (unsigned long long)size >> 20,
+	  hp[n].name, shm_name ? " shared as " : "", shm_name ? shm_name : "");
+	if (numa_node >= 0) fprintf(stderr, "NUMA node %d, ", numa_node);
+	if (rl.rlim_cur == RLIM_INFINITY) fprintf(stderr, "memlock unlimited\n");
+	else {
+		fprintf(stderr, "memlock limit %llu MB\n",
+		  (unsigned long long)rl.rlim_cur >> 20);
+		if (rl.rlim_cur < size + ring.size && geteuid() != 0)
+			fprintf(stderr, "Warning: FIFO exceeds RLIMIT_MEMLOCK, "
+			  "it will not be locked\n");
+	}
+	return 0;
+}
+
+/* Zero-copy output.  When stdout is a pipe, FIFO pages are handed to it with
+ * vmsplice(); for a socket they go through a private pipe and splice().  The
+ * kernel then references the FIFO pages instead of copying them, so FIFO
+ * space is only given back to the producer once the bytes have left the
+ * pipe (FIONREAD) and, for TCP, have been acknowledged (SIOCOUTQ).
+ */
+static int zc_mode; /* 0: write(), ZC_PIPE or ZC_SOCKET */
+static int zc_pipe[2];
+enum { ZC_PIPE = 1, ZC_SOCKET };
+
+static void zc_pipe_size(int fd) {
+	FILE *f;
+	int max = 0;
+
+	if (fcntl(fd, F_SETPIPE_SZ, 4 * MAX_WRITE) != -1) return;
+	f = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (f) {
+		if (fscanf(f, "%d", &max) != 1) max = 0;
+		fclose(f);
+	}
+	if (max > 0) fcntl(fd, F_SETPIPE_SZ, max);
+}
+
+static void zc_init(void) {
+	struct stat st;
+
+	if (fstat(1, &st) == -1) return;
+	if (S_ISFIFO(st.st_mode)) {
+		zc_mode = ZC_PIPE;
+		zc_pipe[1] = 1;
+	} else if (S_ISSOCK(st.st_mode) && pipe(zc_pipe) == 0) {
+		zc_mode = ZC_SOCKET;
+	} else {
+		fprintf(stderr, "stdout is not a pipe or socket, using write()\n");
+		return;
+	}
+	zc_pipe_size(zc_pipe[1]);
+}
+
+static ssize_t zc_write(uint8_t *b, size_t len) {
+	struct iovec iov = { b, len };
+	ssize_t r, n, i;
+
+	r = vmsplice(zc_pipe[1], &iov, 1, 0);
+	if (r <= 0 || zc_mode == ZC_PIPE) return r;
+
+	/* Drain all of it into the socket so the private pipe stays empty */
+	for (n = r; n > 0; n -= i) {
+		i = splice(zc_pipe[0], NULL, 1, NULL, n, SPLICE_F_MOVE|SPLICE_F_MORE);
+		if (i == -1 && errno == EINTR) i = 0;
+		else if (i == -1) return -1;
+	}
+	return r;
+}
+
+/* Oldest position the kernel may still be reading from */
+static uint64_t zc_consumed(uint64_t sent) {
+	int n = 0, q = 0;
+
+	ioctl(zc_pipe[1], FIONREAD, &n);
+	if (zc_mode == ZC_SOCKET) ioctl(1, SIOCOUTQ, &q);
+	return sent - n - q;
+}
+
+/* --shed: when the FIFO fill trend says it will overflow within shed.secs,
+ * step the --blocks stream down one stage at a time: delta coding, then
+ * only the shed.keep channels as well, then averaging every shed.decim
+ * samples as well.  Steps down are at least SHED_DOWN apart, long enough for
+ * the last one to show in the slope; steps back up SHED_UP apart, once the
+ * FIFO is under a quarter full and no longer filling.  The fill slope is
+ * smoothed over SHED_SAMPLE periods; the consumers' drain rate is what
+ * comes in less that.
+ */
+#define SHED_SAMPLE 100000000ULL /* ns */
+#define SHED_DOWN 500000000ULL
+#define SHED_UP 2000000000ULL
+#define SHED_STAGES 3
+enum { SHED_PACK = 1, SHED_CHANNELS, SHED_DECIMATE };
+static struct {
+	double secs;         /* 0: off */
+	uint32_t keep;       /* Channel mask kept from SHED_CHANNELS on */
+	uint32_t decim;
+	_Atomic int stage;
+	_Atomic uint64_t changes;
+	_Atomic int64_t slope, drain; /* Bytes/s */
+} shed = { 0, 0x3, 4 };
+
+/* DMA poll scheduler statistics, written by fpga_loop() only */
+#define LATE_BUCKETS 21 /* log2 microseconds, the last one is >= 0.5s */
+static struct {
+	_Atomic uint64_t polls, late[LATE_BUCKETS];
+	_Atomic uint32_t peak;     /* Most bytes ever pending in the DMA ring */
+	_Atomic uint64_t rate;     /* Observed DMA rate, bytes/s */
+	_Atomic uint64_t interval; /* Current poll interval, ns */
+	_Atomic uint64_t dropped;  /* Samples lost to a full FIFO */
+	_Atomic uint64_t hard_ovf, hard_lost; /* Hard FIFO overflows survived */
+	_Atomic uint64_t hard_last; /* CLOCK_REALTIME ns of the latest */
+} pstats;
+static int stats_secs = -1;
+
+/* Age of the oldest sample in each write when it is handed to the kernel */
+#define AGE_BUCKET_US 10
+#define AGE_BUCKETS 2000 /* The last one is everything >= 20ms */
+static _Atomic uint64_t age_hist[AGE_BUCKETS], age_max;
+
+static void age_record(uint64_t ns) {
+	uint64_t us = ns / 1000, b = us / AGE_BUCKET_US;
+
+	age_hist[b < AGE_BUCKETS ? b : AGE_BUCKETS - 1]++;
+	if (us > age_max) age_max = us;
+}
+
+static void age_report(void) {
+	static const double pct[] = { 50, 99, 99.9 };
+	uint64_t total = 0, sum = 0;
+	int i, p = 0;
+
+	for (i = 0; i < AGE_BUCKETS; i++) total += age_hist[i];
+	if (total == 0) return;
+	fprintf(stderr, "latency:");
+	for (i = 0; i < AGE_BUCKETS && p < 3; i++) {
+		sum += age_hist[i];
+		while (p < 3 && sum * 100.0 >= total * pct[p]) {
+			if (i == AGE_BUCKETS - 1) fprintf(stderr, " p%g >=%dus", pct[p],
+			  i * AGE_BUCKET_US);
+			else fprintf(stderr, " p%g <%dus", pct[p], (i + 1) * AGE_BUCKET_US);
+			p++;
+		}
+	}
+	fprintf(stderr, " max %lluus over %llu writes\n",
+	  (unsigned long long)age_max, (unsigned long long)total);
+}
+
+/* Min/max over the batches since the last report, and the CRC so far */
+static void xf_report(void) {
+	static uint64_t k;
+	uint64_t nb = atomic_load_explicit(&fifo.nbatch, memory_order_acquire);
+	int16_t lo[4] = { INT16_MAX, INT16_MAX, INT16_MAX, INT16_MAX };
+	int16_t hi[4] = { INT16_MIN, INT16_MIN, INT16_MIN, INT16_MIN };
+	struct batch *bt;
+	int c;
+
+	if (nb == 0) return;
+	if (nb - k > NBATCH) k = nb - NBATCH;
+	for (; xf.minmax && k < nb; k++)
+		for (bt = &fifo.batch[k % NBATCH], c = 0; c < 4; c++) {
+			if (bt->min[c] < lo[c]) lo[c] = bt->min[c];
+			if (bt->max[c] > hi[c]) hi[c] = bt->max[c];
+		}
+	if (xf.minmax && lo[0] <= hi[0]) {
+		fprintf(stderr, "levels:");
+		for (c = 0; c < 4; c++)
+			if (xf.keep & 1 << c)
+				fprintf(stderr, " ch%d %d..%d", c + 1, lo[c], hi[c]);
+		fprintf(stderr, "\n");
+	}
+	bt = &fifo.batch[(nb - 1) % NBATCH];
+	if (xf.crc)
+		fprintf(stderr, "crc32c: 0x%08x over the first %llu bytes\n", bt->crc,
+		  (unsigned long long)bt->end);
+}
+
+static void stats_report(void) {
+	uint64_t rate = pstats.rate, peak = pstats.peak;
+	time_t last_ovf;
+	struct tm tm;
+	char ts[32];
+	int i;
+
+	fprintf(stderr, "poll: %llu wakeups, %.1f MB/s, interval %.2f ms, "
+	  "peak hard FIFO %llu KB (%llu%%), margin %.1f ms, copy %s\n",
+	  (unsigned long long)pstats.polls, rate / 1e6, pstats.interval / 1e6,
+	  (unsigned long long)peak >> 10,
+	  (unsigned long long)peak * 100 / ring.size,
+	  rate ? (ring.size - peak) * 1e3 / rate : 0.0, copy_name);
+	fprintf(stderr, "poll: lateness");
+	for (i = 0; i < LATE_BUCKETS; i++) {
+		if (pstats.late[i] == 0) continue;
+		if (i == LATE_BUCKETS - 1)
+			fprintf(stderr, " >=%uus:", 1 << (LATE_BUCKETS - 2));
+		else fprintf(stderr, " <%uus:", 1 << i);
+		fprintf(stderr, "%llu", (unsigned long long)pstats.late[i]);
+	}
+	fprintf(stderr, "\n");
+	age_report();
+	if (pstats.dropped)
+		fprintf(stderr, "fifo: full, dropped %llu samples\n",
+		  (unsigned long long)pstats.dropped);
+	if (pstats.hard_ovf) {
+		last_ovf = pstats.hard_last / 1000000000;
+		strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&last_ovf, &tm));
+		fprintf(stderr, "dma: %llu hard FIFO overflows, ~%llu samples lost, "
+		  "last at %s\n", (unsigned long long)pstats.hard_ovf,
+		  (unsigned long long)pstats.hard_lost, ts);
+	}
+	if (xf.minmax || xf.crc) xf_report();
+	if (shed.secs)
+		fprintf(stderr, "shed: stage %d, FIFO filling at %.1f MB/s, drained "
+		  "at %.1f MB/s, %llu stage changes\n", shed.stage, shed.slope / 1e6,
+		  shed.drain / 1e6, (unsigned long long)shed.changes);
+	if (spill.path)
+		fprintf(stderr, "spill: %llu MB written, at most %llu MB behind on "
+		  "disk\n", (unsigned long long)spill.written >> 20,
+		  (unsigned long long)spill.peak >> 20);
+	for (i = 0; i < nsinks; i++)
+		if (sinks[i].lossy || sinks[i].skipped)
+			fprintf(stderr, "%s: skipped %llu KB\n", sinks[i].name,
+			  (unsigned long long)sinks[i].skipped >> 10);
+	for (i = 0; fifo.shm && i < TSMINI2_SHM_READERS; i++)
+		if (fifo.shm->reader[i].pid && kill(fifo.shm->reader[i].pid, 0) == 0)
+			fprintf(stderr, "shm: reader %u behind %llu KB, lost %llu KB\n",
+			  fifo.shm->reader[i].pid, (unsigned long long)(fifo.shm->put -
+			  fifo.shm->reader[i].get) >> 10,
+			  (unsigned long long)fifo.shm->reader[i].lost >> 10);
+}
+
+static void *stats_loop(void *x) {
+	for (;;) {
+		sleep(stats_secs);
+		stats_report();
+	}
+	return NULL;
+}
+
+/* The DMA ring is polled at absolute CLOCK_MONOTONIC deadlines chosen so
+ * that, at the DMA rate observed so far, the ring is HARD_FIFO_TARGET full
+ * when we get there.
+ */
+#define HARD_FIFO_TARGET (ring.size / 4 * 3)
+#define MIN_LATENCY_US 1000
+
+/* --low-latency instead forwards every LL_BLOCK as soon as it shows up,
+ * busy-polling on ll_cpu if one was given and polling every LL_POLL_US
+ * otherwise.
+ */
+#define LL_BLOCK 4096
+#define LL_POLL_US 50
+static int ll_mode, ll_cpu = -1;
+
+/* What fpga_loop() does with a full FIFO: stop and flush it (the default),
+ * throw away new samples, or have the sinks give up their oldest backlog
+ * (dropping new samples too until they have).  Once dropping it keeps at it
+ * until OVF_RESUME of the FIFO is free, so there are only ever a few gaps in
+ * it and the gap log covers all of them.  Each run of losses is logged with
+ * gap_put() so sinks can account for it.
+ */
+#define OVF_RESUME (fifo.size / 8)
+enum { OVF_TERMINATE, OVF_DROP_NEWEST, OVF_DROP_OLDEST };
+static int ovf_policy;
+
+static void shed_update(uint64_t nf, uint64_t t, double rate) {
+	static uint64_t t0, nf0, tchange;
+	static double slope;
+	double tto;
+	int stage = shed.stage;
+
+	if (t - t0 < SHED_SAMPLE) return;
+	if (t0) slope += (((double)nf - nf0) * 1e9 / (t - t0) - slope) / 4;
+	t0 = t;
+	nf0 = nf;
+	shed.slope = slope;
+	shed.drain = rate - slope;
+
+	tto = slope > 0 ? (fifo.size - nf) / slope : 1e9;
+	if (tto < shed.secs && stage < SHED_STAGES && t - tchange >= SHED_DOWN)
+		stage++;
+	else if (slope <= 0 && nf < fifo.size / 4 && stage > 0 &&
+	  t - tchange >= SHED_UP)
+		stage--;
+	else return;
+	tchange = t;
+	shed.stage = stage;
+	shed.changes++;
+	fprintf(stderr, "shed: stage %d at sample %llu, FIFO %llu%% full, "
+	  "filling at %.1f MB/s\n", stage,
+	  (unsigned long long)pos_sample(&fifo, fifo.put),
+	  (unsigned long long)nf * 100 / fifo.size, slope / 1e6);
+}
+
+/* SIGINT/SIGTERM stop acquisition; the backlog is flushed before exit */
+static volatile sig_atomic_t stop_req;
+
+static void stop_handler(int sig) {
+	stop_req = 1;
+}
+
+static void *fpga_loop(void *x) {
+	uint32_t cur, clast = last, pcur = last, n, avail, drop;
+	uint64_t nf, t, tlast, deadline, dt, late, to, lost = 0, pt, est, first;
+	double rate, nominal, interval;
+	struct sched_param sched;
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	int tfd, i, hard;
+
+	nominal = (double)SAMPLE_RATE * SAMPLE_BYTES;
+	if (dev == &sim_backend) nominal *= sim_mult;
+	rate = nominal;
+
+	/* The poll interval at the nominal rate is the deadline period */
+	interval = HARD_FIFO_TARGET * 1e9 / nominal;
+	if (interval < MIN_LATENCY_US * 1000.0) interval = MIN_LATENCY_US * 1000.0;
+	else if (interval > MAX_LATENCY_US * 1000.0)
+		interval = MAX_LATENCY_US * 1000.0;
+
+	/* Linux trick for improved realtime determinism: */
+	if (!dl_pct || dl_setup(interval) != 0) {
+		sched.sched_priority = 99;
+		pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
+	}
+
+	if (!pin_self("producer") && ll_cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(ll_cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "Can not pin DMA poll thread to CPU %d\n", ll_cpu);
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	assert(tfd != -1);
+	tlast = pt = deadline = now_ns(CLOCK_MONOTONIC);
+
+superloop:
+	t = now_ns(CLOCK_MONOTONIC);
+	cur = reg_rd(REG_DMAPTR) - dmabuf_phys;
+	hard = cur & 1; /* Hard FIFO overflow, DMA stopped at cur */
+	cur &= ~3;
+
+	late = t > deadline ? (t - deadline) / 1000 : 0;
+	for (i = 0; late && i < LATE_BUCKETS - 1; i++) late >>= 1;
+	pstats.late[i]++;
+	pstats.polls++;
+
+	/* With only lossy sinks left nothing is ever held back */
+	if (!nstrict) atomic_store(&fifo.get, fifo.put);
+	nf = fifo.put - atomic_load_explicit(&fifo.get, memory_order_acquire);
+	n = ring_dist(last, cur);
+	if (n > pstats.peak) pstats.peak = n;
+
+	/* Rate over at least 1ms, low latency polls are too short to measure */
+	dt = t - tlast;
+	if (dt >= MIN_LATENCY_US * 1000) {
+		rate += (ring_dist(clast, cur) * 1e9 / dt - rate) / 4;
+		tlast = t;
+		clast = cur;
+	}
+	/* A lapped ring reads as a slow one; never trust less than half rate */
+	if (rate < nominal / 2) rate = nominal / 2;
+	pstats.rate = rate;
+
+	avail = n;
+	if (xf.on) n &= ~(SAMPLE_BYTES - 1);
+	if (fifo.size - nf <= xf_bytes(n))
+		n = ((fifo.size - nf - 1) & ~0x7f) / fifo.sample_bytes * SAMPLE_BYTES;
+	if (lost && fifo.size - nf < OVF_RESUME) n = 0;
+	if (ll_mode && n < LL_BLOCK) n = 0;
+
+	if (n > 0 && lost) {
+		gap_put(&fifo, fifo.put, lost);
+		lost = 0;
+	}
+	if (n > 0) {
+		dma_sync(last, n, 1);
+		buf_put(dmabuf + last, n, t);
+		dma_sync(last, n, 0);
+	}
+
+	last = ring_adv(last, n);
+	nf += xf_bytes(n);
+	if (n > 0) fifo_wake(&fifo);
+	if (shed.secs)
+		shed_update(nf, t, rate * fifo.sample_bytes / SAMPLE_BYTES);
+
+	// Soft FIFO overflow; close stdout, we failed
+	if (nf >= fifo.size - 1 - 128 && ovf_policy == OVF_TERMINATE) {
+		fifo_stop(&fifo, 1);
+		return (void *)1;
+	} else if (nf >= fifo.size - 1 - 128 || lost) {
+		/* Keep acquiring; what did not fit is gone */
+		drop = (avail - n) & ~(SAMPLE_BYTES - 1);
+		lost += drop / SAMPLE_BYTES;
+		pstats.dropped += drop / SAMPLE_BYTES;
+		last = ring_adv(last, drop);
+		/* Ask for half the FIFO back, 4KB aligned for O_DIRECT sinks */
+		to = (fifo.put - fifo.size / 2) & ~(uint64_t)4095;
+		for (i = 0; ovf_policy == OVF_DROP_OLDEST && i < nsinks; i++)
+			if (!sinks[i].lossy && !sinks[i].noskip &&
+			  sinks[i].skip_to < to) {
+				sinks[i].skip_to = to;
+				fifo_wake(&fifo);
+			}
+	}
+
+	/* Take what the ring still had, re-arm DMA and carry on from wherever
+	 * the card says it restarted, logging a gap for what was missed.  That
+	 * is only known from the nominal rate: whatever it should have produced
+	 * from the last poll until the pointer was read back, minus what
+	 * arrived, plus anything left behind in the ring.
+	 */
+	if (hard) {
+		n = ring_dist(pcur, cur);
+		est = ring_dist(last, cur);
+		reg_wr(REG_DMABASE, dmabuf_phys);
+		cur = (reg_rd(REG_DMAPTR) - dmabuf_phys) & ~3;
+		t = now_ns(CLOCK_MONOTONIC);
+		dt = (t - pt) * nominal / 1e9;
+		est = ((dt > n ? dt - n : 0) + est) / SAMPLE_BYTES;
+		last = clast = cur;
+		tlast = t;
+		/* Where the gap starts, soft drops pending with it included */
+		first = pos_sample(&fifo, fifo.put);
+		gap_put(&fifo, fifo.put, lost + est);
+		lost = 0;
+		fifo_wake(&fifo);
+		pstats.hard_ovf++;
+		pstats.hard_lost += est;
+		pstats.hard_last = now_ns(CLOCK_REALTIME);
+		fprintf(stderr, "Hard FIFO overflow at sample %llu, ~%llu samples "
+		  "lost, DMA re-armed (realtime kernel bug?)\n",
+		  (unsigned long long)first, (unsigned long long)est);
+	}
+	pcur = cur;
+	pt = t;
+
+	if (stop_req) {
+		if (lost) gap_put(&fifo, fifo.put, lost);
+		fifo_stop(&fifo, 0);
+		return NULL;
+	}
+
+	/* Whatever was left in the ring counts against the next interval */
+	n = ring_dist(last, cur);
+	interval = n < HARD_FIFO_TARGET && rate > 0 ?
+	  (HARD_FIFO_TARGET - n) * 1e9 / rate : 0;
+	if (interval < MIN_LATENCY_US * 1000.0) interval = MIN_LATENCY_US * 1000.0;
+	else if (interval > MAX_LATENCY_US * 1000.0)
+		interval = MAX_LATENCY_US * 1000.0;
+	if (ll_mode) {
+		if (ll_cpu >= 0) {
+			/* Busy polling, every poll is on time */
+			deadline = t;
+			goto superloop;
+		}
+		interval = LL_POLL_US * 1000.0;
+	}
+	pstats.interval = interval;
+
+	deadline = t + (uint64_t)interval;
+	its.it_value.tv_sec = deadline / 1000000000;
+	its.it_value.tv_nsec = deadline % 1000000000;
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	while (read(tfd, &dt, sizeof(dt)) == -1 && errno == EINTR);
+	goto superloop;
+
+	return NULL;
+}
+
+/* --blocks: stdout carries struct tsmini2_blk framed blocks of at most
+ * blk_bytes, see tsmini2-blocks.h.  A block never spans a producer gap, so
+ * its sample index holds for all of it.
+ */
+static uint32_t blk_bytes;
+static uint32_t blk_config; /* REG_CFG as acquisition started */
+
+/* --shed: reduce the len bytes at b as stage says, the result's flags in
+ * *flags.  Only whole groups of shed.decim samples are averaged.  The FIFO
+ * has the xf.keep channels to start with.
+ */
+static const uint8_t *shed_apply(const uint8_t *b, uint32_t *len, int stage,
+  uint32_t *flags) {
+	static int16_t avg[MAX_WRITE / 2];
+	static uint8_t packed[MAX_WRITE];
+	const int16_t *in = (const int16_t *)b;
+	uint32_t keep = xf.keep, d = 1, i, j, c, k, n = 0, m;
+	uint32_t nin = __builtin_popcount(xf.keep);
+	int32_t sum;
+
+	if (stage >= SHED_CHANNELS && (shed.keep & xf.keep))
+		keep = shed.keep & xf.keep;
+	if (stage >= SHED_DECIMATE && *len % (shed.decim * fifo.sample_bytes) == 0)
+		d = shed.decim;
+	if (keep != xf.keep || d > 1) {
+		for (i = 0; i < *len / fifo.sample_bytes; i += d)
+			for (c = 0, k = 0; c < 4; c++) {
+				if (!(xf.keep & 1 << c)) continue;
+				if (keep & 1 << c) {
+					for (sum = 0, j = 0; j < d; j++)
+						sum += in[(i + j) * nin + k];
+					avg[n++] = sum / (int32_t)d;
+				}
+				k++;
+			}
+		b = (const uint8_t *)avg;
+		*len = n * 2;
+	}
+	*flags = (keep != 0xf ? keep : 0) | (d > 1 ? d << 8 : 0) | stage << 24;
+	m = tsmini2_pack(packed, *len, b, *len, __builtin_popcount(keep));
+	if (m) {
+		*flags |= TSMINI2_BLK_PACKED;
+		*len = m;
+		b = packed;
+	}
+	return b;
+}
+
+/* When the sample at FIFO position pos came in, in CLOCK_MONOTONIC ns: the
+ * poll that found it, backed off at the DMA rate.  Now if the batch log no
+ * longer has it.  *k is the fifo_batch() hint.
+ */
+static uint64_t pos_mono(uint64_t pos, uint64_t *k) {
+	struct batch *bt = fifo_batch(&fifo, pos, k);
+	uint64_t rate = pstats.rate;
+
+	if (bt == NULL) return now_ns(CLOCK_MONOTONIC);
+	if (rate == 0) return bt->mono;
+	return bt->mono - (bt->end - pos) / fifo.sample_bytes * SAMPLE_BYTES *
+	  1000000000ULL / rate;
+}
+
+/* Write the block of len bytes at FIFO position pos in full, reduced as
+ * --shed's stage says, else -1
+ */
+static ssize_t blk_write(const uint8_t *b, uint32_t len, uint64_t pos,
+  uint64_t seq, uint64_t *k, int stage) {
+	static int pstage;
+	struct tsmini2_blk h;
+	struct iovec iov[2];
+	uint64_t mono, now = now_ns(CLOCK_MONOTONIC);
+	uint32_t flags = xf.keep != 0xf ? xf.keep : 0, plen = len;
+	fd_set wfds;
+	ssize_t r;
+
+	if (stage) b = shed_apply(b, &plen, stage, &flags);
+	if (stage != pstage) flags |= TSMINI2_BLK_RESTAGED;
+	pstage = stage;
+
+	mono = pos_mono(pos, k);
+
+	h.magic = htole32(TSMINI2_BLK_MAGIC);
+	h.version = htole16(TSMINI2_BLK_VERSION);
+	h.hdr_len = htole16(sizeof(h));
+	h.seq = htole64(seq);
+	h.sample = htole64(pos_sample(&fifo, pos));
+	h.realtime_ns = htole64(now_ns(CLOCK_REALTIME) - (now - mono));
+	h.mono_ns = htole64(mono);
+	h.len = htole32(plen);
+	h.channels = htole16(TSMINI2_BLK_CHANS(flags) ?
+	  __builtin_popcount(TSMINI2_BLK_CHANS(flags)) : 4);
+	h.bits = htole16(16);
+	h.config = htole32(blk_config);
+	h.flags = htole32(flags);
+	h.crc = htole32(tsmini2_crc32c(0, b, plen));
+	h.hdr_crc = htole32(tsmini2_crc32c(0, &h, offsetof(struct tsmini2_blk,
+	  hdr_crc)));
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = (void *)b;
+	iov[1].iov_len = plen;
+	FD_ZERO(&wfds);
+	while (iov[1].iov_len) {
+		r = writev(1, iov[0].iov_len ? iov : iov + 1, iov[0].iov_len ? 2 : 1);
+		if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			FD_SET(1, &wfds);
+			select(2, NULL, &wfds, NULL, NULL);
+			continue;
+		} else if (r == -1 && errno == EINTR) {
+			continue;
+		} else if (r == -1) {
+			return -1;
+		}
+		if (r >= (ssize_t)iov[0].iov_len) {
+			r -= iov[0].iov_len;
+			iov[0].iov_len = 0;
+			iov[1].iov_base = (uint8_t *)iov[1].iov_base + r;
+			iov[1].iov_len -= r;
+		} else {
+			iov[0].iov_base = (uint8_t *)iov[0].iov_base + r;
+			iov[0].iov_len -= r;
+		}
+	}
+	return len;
+}
+
+/* Default sink: copy (or vmsplice) the FIFO to stdout */
+static int stdout_run(struct sink *s) {
+	uint64_t get, sent = 0, k = 0, seq = 0, n;
+	struct batch *bt;
+	fd_set wfds;
+	uint8_t *b;
+	ssize_t r;
+	int stage;
+
+	FD_ZERO(&wfds);
+
+	/* fifo_wait() only comes back empty once the producer has stopped */
+	while ((r = fifo_wait(&fifo, sent)) > 0) {
+		/* Pipe pages may still point into the FIFO, no skipping then */
+		if (!zc_mode && (get = sink_skip(s, sent)) != sent) {
+			sent = get;
+			sink_release(s, sent);
+			continue;
+		}
+		if (r > MAX_WRITE) r = MAX_WRITE;
+		if (blk_bytes && r > blk_bytes) r = blk_bytes;
+		if (blk_bytes) r = sink_clip(s, sent, r);
+		/* Whole groups to average, unless that is all there is */
+		stage = shed.stage;
+		if (stage >= SHED_DECIMATE && r >= shed.decim * fifo.sample_bytes)
+			r -= r % (shed.decim * fifo.sample_bytes);
+		n = r;
+		if ((b = sink_read(s, &sent, &n)) == NULL) continue;
+
+		if (zc_mode) r = zc_write(b, n);
+		else if (blk_bytes) r = blk_write(b, n, sent, seq++, &k, stage);
+		else r = write(1, b, n);
+
+		if (r == 0 || (r==-1 && (errno==EAGAIN||errno==EWOULDBLOCK))) {
+			/* This shouldn't happen unless stdout is O_NONBLOCK */
+			FD_SET(1, &wfds);
+			select(2, NULL, &wfds, &wfds, NULL);
+			continue;
+		} else if (r == -1 && errno == EINTR) {
+			continue;
+		} else if (r == -1) {
+			perror("stdout");
+			return 2;
+		}
+		if ((bt = fifo_batch(&fifo, sent, &k)) != NULL)
+			age_record(now_ns(CLOCK_MONOTONIC) - bt->mono);
+		sent += r;
+		get = zc_mode ? zc_consumed(sent) : sent;
+		sink_release(s, get);
+	}
+
+	return fifo.done - 1;
+}
+
+/* --shm: the FIFO is the shared memory object and buf_put() keeps its
+ * header current, so all this sink does is pass the producer's wakeups on to
+ * readers parked on the header.  It never holds the FIFO back.
+ */
+static int shm_run(struct sink *s) {
+	struct tsmini2_shm *h = fifo.shm;
+	uint64_t put = 0, r;
+
+	do {
+		r = fifo_wait(&fifo, put);
+		put += r;
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&h->parked, memory_order_relaxed)) {
+			h->parked = 0;
+			futex(&h->parked, FUTEX_WAKE, INT_MAX);
+		}
+	} while (r > 0);
+	return fifo.done - 1;
+}
+
+/* Minimal io_uring plumbing, raw syscalls so there is no liburing needed */
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned pending; /* SQEs queued but not yet submitted */
+};
+
+static int uring_init(struct uring *u, unsigned entries) {
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(*u));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd == -1) return -1;
+
+	sq = mmap(0, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+	  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	cq = mmap(0, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),
+	  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+	  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+		close(u->fd);
+		return -1;
+	}
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u) {
+	unsigned tail = *u->sq_tail + u->pending;
+	struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+
+	u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+	u->pending++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* Submit queued SQEs and optionally wait for a completion */
+static int uring_enter(struct uring *u, unsigned wait) {
+	unsigned n = u->pending;
+	int r;
+
+	__atomic_store_n(u->sq_tail, *u->sq_tail + n, __ATOMIC_RELEASE);
+	u->pending = 0;
+	do r = syscall(__NR_io_uring_enter, u->fd, n, wait,
+	  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while (r == -1 && errno == EINTR);
+	return r;
+}
+
+static struct io_uring_cqe *uring_cqe(struct uring *u) {
+	unsigned head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &u->cqes[head & *u->cq_mask];
+}
+
+static void uring_cqe_seen(struct uring *u) {
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Capture-to-file sink.  Up to URING_QD aligned O_DIRECT writes of up to
+ * URING_CHUNK are kept in flight straight out of the FIFO, which is
+ * registered as fixed buffers, to a registered file.  FIFO space is released
+ * in order as writes complete.  The unaligned tail is written at close with
+ * O_DIRECT cleared.  Filesystems without O_DIRECT get buffered writes whose
+ * page cache is written back and dropped as we go.
+ */
+#define URING_QD 8
+#define URING_CHUNK 0x100000
+#define DIO_ALIGN 4096
+#define REG_BUF_MAX (1ULL << 30) /* io_uring limit per registered buffer */
+
+#define QD_MAX 64
+
+struct dio {
+	uint64_t pos, off; /* FIFO position and file offset */
+	uint32_t len, done;
+};
+
+struct filesink {
+	struct uring u;
+	int fd, direct, nbufs;
+	/* Registered buffer k covers [k * half, k * half + 2 * half) */
+	uint64_t half;
+	uint64_t base;   /* FIFO position of file offset 0 */
+	struct dio io[QD_MAX];
+	unsigned qd, head, tail; /* In-flight writes, in FIFO order */
+};
+
+static int fs_register(struct filesink *fs) {
+	struct iovec iov[1024];
+	uint64_t win = 2 * fifo.size < REG_BUF_MAX ? 2 * fifo.size : REG_BUF_MAX;
+	int n;
+
+	fs->half = win / 2;
+	for (n = 0; n * fs->half < fifo.size && n < 1024; n++) {
+		iov[n].iov_base = fifo.buf + n * fs->half;
+		iov[n].iov_len = win;
+	}
+	if (n * fs->half < fifo.size) return -1;
+	if (syscall(__NR_io_uring_register, fs->u.fd, IORING_REGISTER_BUFFERS,
+	  iov, n) != 0) return -1;
+	fs->nbufs = n;
+	return 0;
+}
+
+static void fs_submit(struct filesink *fs, struct dio *io) {
+	struct io_uring_sqe *sqe = uring_sqe(&fs->u);
+	uint64_t i = io->pos % fifo.size;
+
+	sqe->opcode = fs->nbufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0;
+	sqe->addr = (uint64_t)(uintptr_t)&fifo.buf[i];
+	sqe->len = io->len;
+	sqe->off = io->off;
+	if (fs->nbufs) sqe->buf_index = i / fs->half;
+	sqe->user_data = io - fs->io;
+}
+
+/* Reap completions, returns the FIFO position up to which all is written */
+static int fs_reap(struct filesink *fs, uint64_t *released) {
+	struct io_uring_cqe *cqe;
+	struct dio *io;
+	uint64_t off;
+
+	while ((cqe = uring_cqe(&fs->u)) != NULL) {
+		io = &fs->io[cqe->user_data];
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			uring_cqe_seen(&fs->u);
+			return -1;
+		}
+		uring_cqe_seen(&fs->u);
+		if (cqe->res < io->len) {
+			/* Short write, send the rest */
+			io->pos += cqe->res;
+			io->off += cqe->res;
+			io->len -= cqe->res;
+			fs_submit(fs, io);
+			continue;
+		}
+		io->done = 1;
+		if (!fs->direct) {
+			sync_file_range(fs->fd, io->off, io->len, SYNC_FILE_RANGE_WRITE);
+			/* Pages still under writeback would not be dropped, so
+			 * wait out an older range, long since started, first.
+			 */
+			if (io->off >= URING_QD * URING_CHUNK) {
+				off = io->off - URING_QD * URING_CHUNK;
+				sync_file_range(fs->fd, off, io->len,
+				  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				  SYNC_FILE_RANGE_WAIT_AFTER);
+				posix_fadvise(fs->fd, off, io->len, POSIX_FADV_DONTNEED);
+			}
+		}
+	}
+	for (; fs->head != fs->tail && fs->io[fs->head % fs->qd].done; fs->head++) {
+		io = &fs->io[fs->head % fs->qd];
+		*released = io->pos + io->len;
+	}
+	return 0;
+}
+
+/* --capture-dir splits the capture into segment files of seg.size bytes or
+ * seg.ns of data, named after the index of their first sample and when
+ * that sample came in.  A background thread keeps a preallocated spare
+ * segment ready, renames it once it is put to use and truncates, fsyncs and
+ * closes finished segments, so the writer never waits on filesystem
+ * metadata.
+ */
+#define SEG_JOBS 8
+#define SEG_SIZE (1ULL << 30)
+
+struct segjob {
+	int fd;            /* Finished segment, -1 if none */
+	uint64_t len;
+	char from[PATH_MAX], to[PATH_MAX]; /* Spare being put to use */
+};
+
+static struct {
+	char *dir;
+	uint64_t size, ns, alloc;
+	uint64_t samples;  /* Per segment for --segment-time */
+	uint64_t first;    /* Index of the current segment's first sample */
+	int direct;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int spare_fd;      /* -1 while the next spare is being made */
+	char spare[PATH_MAX];
+	unsigned nspare, head, tail;
+	struct segjob job[SEG_JOBS];
+} seg = { NULL, 0, 0, 0, 0, 0, 1, PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, -1 };
+
+static int seg_make_spare(char *path) {
+	int fd;
+
+	snprintf(path, PATH_MAX, "%s/.spare-%u.tmp", seg.dir, seg.nspare++);
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|(seg.direct ? O_DIRECT : 0), 0644);
+	if (fd == -1 && seg.direct && errno == EINVAL) {
+		seg.direct = 0;
+		fprintf(stderr, "%s: no O_DIRECT, using page cache\n", seg.dir);
+		fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	}
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, seg.alloc);
+	return fd;
+}
+
+static void *seg_loop(void *x) {
+	struct segjob *j;
+	char path[PATH_MAX];
+	int fd;
+
+	pthread_mutex_lock(&seg.lock);
+	for (;;) {
+		while (seg.head == seg.tail && seg.spare_fd != -1)
+			pthread_cond_wait(&seg.cond, &seg.lock);
+
+		if (seg.head != seg.tail) {
+			j = &seg.job[seg.head % SEG_JOBS];
+			pthread_mutex_unlock(&seg.lock);
+			if (j->from[0] && rename(j->from, j->to) != 0) perror(j->to);
+			if (j->fd != -1) {
+				if (ftruncate(j->fd, j->len) != 0 || fsync(j->fd) != 0)
+					perror(seg.dir);
+				close(j->fd);
+			}
+			pthread_mutex_lock(&seg.lock);
+			seg.head++;
+		} else {
+			pthread_mutex_unlock(&seg.lock);
+			fd = seg_make_spare(path);
+			if (fd == -1) exit(2);
+			pthread_mutex_lock(&seg.lock);
+			strcpy(seg.spare, path);
+			seg.spare_fd = fd;
+		}
+		pthread_cond_broadcast(&seg.cond);
+	}
+	return NULL;
+}
+
+/* Finish segment fd (if any) at len bytes, return the one starting at pos */
+static int seg_next(int fd, uint64_t len, uint64_t pos) {
+	struct segjob *j;
+	struct tm tm;
+	uint64_t k = 0, mono = pos_mono(pos, &k);
+	time_t start;
+	char ts[32];
+	int r;
+
+	/* Named for when its first sample came in, not for now */
+	start = (now_ns(CLOCK_REALTIME) - (now_ns(CLOCK_MONOTONIC) - mono)) /
+	  1000000000;
+	seg.first = pos_sample(&fifo, pos);
+
+	pthread_mutex_lock(&seg.lock);
+	while (seg.spare_fd == -1 || seg.tail - seg.head == SEG_JOBS)
+		pthread_cond_wait(&seg.cond, &seg.lock);
+	j = &seg.job[seg.tail % SEG_JOBS];
+	j->fd = fd;
+	j->len = len;
+	strcpy(j->from, seg.spare);
+	strftime(ts, sizeof(ts), "%Y%m%dT%H%M%SZ", gmtime_r(&start, &tm));
+	snprintf(j->to, PATH_MAX, "%s/%020llu-%s.raw", seg.dir,
+	  (unsigned long long)seg.first, ts);
+	r = seg.spare_fd;
+	seg.spare_fd = -1;
+	seg.tail++;
+	pthread_cond_broadcast(&seg.cond);
+	pthread_mutex_unlock(&seg.lock);
+	return r;
+}
+
+/* Finish the last segment and wait for the background work to settle */
+static void seg_finish(int fd, uint64_t len) {
+	struct segjob *j;
+
+	pthread_mutex_lock(&seg.lock);
+	while (seg.tail - seg.head == SEG_JOBS)
+		pthread_cond_wait(&seg.cond, &seg.lock);
+	j = &seg.job[seg.tail++ % SEG_JOBS];
+	j->fd = fd;
+	j->len = len;
+	j->from[0] = 0;
+	pthread_cond_broadcast(&seg.cond);
+	while (seg.head != seg.tail || seg.spare_fd == -1)
+		pthread_cond_wait(&seg.cond, &seg.lock);
+	close(seg.spare_fd);
+	unlink(seg.spare);
+	pthread_mutex_unlock(&seg.lock);
+}
+
+/* By size, or by samples rather than the writer's clock: a backlog still
+ * makes segments of seg.ns of data each.
+ */
+static int seg_due(struct filesink *fs, uint64_t sent) {
+	if (seg.size) return sent - fs->base >= seg.size;
+	return sent > fs->base && pos_sample(&fifo, sent) - seg.first >= seg.samples;
+}
+
+static char *out_path;
+
+static int file_run(struct sink *s) {
+	const char *path = out_path;
+	struct filesink fs;
+	struct io_uring_files_update up;
+	struct dio *io;
+	struct gap g;
+	uint64_t put, sent = 0, released = 0, n, rem;
+	char gpath[PATH_MAX];
+	pthread_t tid;
+	ssize_t r;
+	int flags;
+
+	memset(&fs, 0, sizeof(fs));
+	fs.direct = 1;
+	fs.qd = URING_QD;
+	if (seg.dir) {
+		path = seg.dir;
+		if (!seg.alloc) seg.alloc = seg.size;
+		pthread_create(&tid, NULL, seg_loop, NULL);
+		fs.fd = seg_next(-1, 0, 0);
+		fs.direct = seg.direct;
+	} else {
+		fs.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0644);
+		if (fs.fd == -1 && errno == EINVAL) {
+			fs.direct = 0;
+			fs.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		}
+		if (fs.fd == -1) {
+			perror(path);
+			return 2;
+		}
+		if (!fs.direct)
+			fprintf(stderr, "%s: no O_DIRECT, using page cache\n", path);
+	}
+	snprintf(gpath, sizeof(gpath), seg.dir ? "%s/tsmini2.gaps" : "%s.gaps",
+	  path);
+	s->gaplog = fopen(gpath, "w");
+	if (s->gaplog == NULL) perror(gpath);
+
+	if (uring_init(&fs.u, URING_QD) != 0) {
+		perror("io_uring_setup");
+		return 2;
+	}
+	if (syscall(__NR_io_uring_register, fs.u.fd, IORING_REGISTER_FILES,
+	  &fs.fd, 1) != 0) {
+		perror("IORING_REGISTER_FILES");
+		return 2;
+	}
+	if (fs_register(&fs) != 0)
+		fprintf(stderr, "Can not register FIFO buffers, not using fixed "
+		  "buffers\n");
+
+	for (;;) {
+		put = atomic_load_explicit(&fifo.put, memory_order_acquire);
+		if ((n = sink_skip(s, sent)) != sent) {
+			/* The file carries on without a hole */
+			fs.base += n - sent;
+			sent = n;
+			if (fs.tail == fs.head) released = sent;
+			sink_release(s, released);
+		}
+
+		/* Full chunks whenever there is room, anything aligned if idle */
+		while (fs.tail - fs.head < fs.qd && (put - sent >= URING_CHUNK ||
+		  (fs.tail == fs.head && put - sent >= DIO_ALIGN))) {
+			if (seg.dir && seg_due(&fs, sent)) {
+				/* Let the old segment's writes land, then switch */
+				if (fs.tail != fs.head) break;
+				fs.fd = seg_next(fs.fd, sent - fs.base, sent);
+				memset(&up, 0, sizeof(up));
+				up.fds = (uintptr_t)&fs.fd;
+				syscall(__NR_io_uring_register, fs.u.fd,
+				  IORING_REGISTER_FILES_UPDATE, &up, 1);
+				fs.base = sent;
+			}
+			n = put - sent;
+			if (n > URING_CHUNK) n = URING_CHUNK;
+			if (seg.size && n > fs.base + seg.size - sent)
+				n = fs.base + seg.size - sent;
+			if (seg.samples) {
+				/* To the next aligned offset past the last sample */
+				rem = (seg.first + seg.samples - pos_sample(&fifo, sent)) *
+				  fifo.sample_bytes;
+				rem = (rem + DIO_ALIGN - 1) & ~(uint64_t)(DIO_ALIGN - 1);
+				if (n > rem) n = rem;
+			}
+			n &= ~(uint64_t)(DIO_ALIGN - 1);
+			io = &fs.io[fs.tail++ % fs.qd];
+			io->pos = sent;
+			io->off = sent - fs.base;
+			io->len = n;
+			io->done = 0;
+			fs_submit(&fs, io);
+			sent += n;
+		}
+
+		if (fs.tail != fs.head || fs.u.pending) {
+			if (uring_enter(&fs.u, fs.tail != fs.head) == -1 ||
+			  fs_reap(&fs, &released) != 0) {
+				perror(path);
+				return 2;
+			}
+			if (fs.tail == fs.head) released = sent;
+			sink_release(s, released);
+		} else if (fifo.done) {
+			break;
+		} else fifo_wait(&fifo, put);
+	}
+
+	/* Unaligned tail; anything the producer added after it stopped is none */
+	put = atomic_load_explicit(&fifo.put, memory_order_acquire);
+	if (put > sent) {
+		flags = fcntl(fs.fd, F_GETFL);
+		fcntl(fs.fd, F_SETFL, flags & ~O_DIRECT);
+		for (n = sent; n < put; n += r) {
+			r = pwrite(fs.fd, &fifo.buf[n % fifo.size], put - n, n - fs.base);
+			if (r == -1 && errno == EINTR) r = 0;
+			else if (r == -1) {
+				perror(path);
+				return 2;
+			}
+		}
+	}
+	while (sink_gap(s, put, &g)) gap_report(s, &g);
+	if (s->gaplog) fclose(s->gaplog);
+	if (seg.dir) seg_finish(fs.fd, put - fs.base);
+	else if (close(fs.fd) != 0) {
+		perror(path);
+		return 2;
+	}
+	return fifo.done - 1;
+}
+
+/* The oldest cursor among the spill sinks */
+static uint64_t spill_low(void) {
+	uint64_t min = UINT64_MAX, p;
+	int i;
+
+	for (i = 0; i < nsinks; i++) {
+		if (!sinks[i].spill) continue;
+		p = atomic_load_explicit(&sinks[i].get, memory_order_acquire);
+		if (p < min) min = p;
+	}
+	return min;
+}
+
+/* --spill writer: the same O_DIRECT io_uring writes as the file sink, but
+ * only ever of FIFO data the spill sinks are more than spill.hwm behind on,
+ * and no further ahead of the oldest of them than the scratch file holds.
+ */
+static void *spill_loop(void *x) {
+	struct filesink fs;
+	struct dio *io;
+	uint64_t put, sent, low, released, old, n;
+
+	memset(&fs, 0, sizeof(fs));
+	fs.direct = 1;
+	fs.qd = URING_QD;
+	fs.fd = open(spill.path, O_WRONLY|O_DIRECT);
+	if (fs.fd == -1 && errno == EINVAL) {
+		fs.direct = 0;
+		fs.fd = open(spill.path, O_WRONLY);
+	}
+	if (fs.fd == -1 || uring_init(&fs.u, URING_QD) != 0 ||
+	  syscall(__NR_io_uring_register, fs.u.fd, IORING_REGISTER_FILES,
+	  &fs.fd, 1) != 0) {
+		perror(spill.path);
+		return NULL;
+	}
+	fs_register(&fs);
+
+	sent = released = 0;
+	for (;;) {
+		put = atomic_load_explicit(&fifo.put, memory_order_acquire);
+		low = spill_low();
+		if (low == UINT64_MAX) break;
+		if (fs.tail == fs.head && low > sent) {
+			/* All of them are past the disk, start over at the oldest */
+			sent = released = low & ~(uint64_t)(DIO_ALIGN - 1);
+			atomic_store(&spill.hi, sent);
+		}
+		while (fs.tail - fs.head < fs.qd && put - sent > spill.hwm) {
+			n = put - sent;
+			if (n > URING_CHUNK) n = URING_CHUNK;
+			if (n > spill.size - sent % spill.size)
+				n = spill.size - sent % spill.size;
+			if (n > low + spill.size - sent) n = low + spill.size - sent;
+			n &= ~(uint64_t)(DIO_ALIGN - 1);
+			if (n == 0) break; /* Scratch file full */
+			io = &fs.io[fs.tail++ % fs.qd];
+			io->pos = sent;
+			io->off = sent % spill.size;
+			io->len = n;
+			io->done = 0;
+			fs_submit(&fs, io);
+			sent += n;
+		}
+
+		if (fs.tail != fs.head || fs.u.pending) {
+			old = released;
+			if (uring_enter(&fs.u, fs.tail != fs.head) == -1 ||
+			  fs_reap(&fs, &released) != 0) {
+				perror(spill.path);
+				break;
+			}
+			/* On disk before anyone goes looking for it there */
+			atomic_store(&spill.hi, released);
+			fifo_release();
+			spill.written += released - old;
+			low = spill_low();
+			if (low < released && released - low > spill.peak)
+				spill.peak = released - low;
+		} else if (fifo.done) {
+			break;
+		} else fifo_wait(&fifo, put);
+	}
+	close(fs.fd);
+	return NULL;
+}
+
+/* --stripe spreads consecutive stripe.block sized FIFO blocks round-robin
+ * over files in several directories, normally on different disks.  Each
+ * stripe has its own writer thread and io_uring with stripe.qd writes in
+ * flight.  FIFO space is released up to the oldest block any stripe still
+ * has pending.  A manifest describing the layout (and, once done, the total
+ * length) is written to every directory; tsmini2-unstripe puts the stream
+ * back together.  Stripes can not skip data, so under
+ * --overflow=drop-oldest they drop newest (see sink_skip()).
+ */
+#define STRIPE_MAX 16
+#define STRIPE_MANIFEST "tsmini2.manifest"
 
-	FD_ZERO(&wfds);
-	pthread_mutexattr_init(&mattr);
-	pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
-	pthread_mutex_init(&buflock, &mattr);
-	pthread_mutexattr_destroy(&mattr);
-	pthread_mutex_lock(&buflock);
-	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, 1024 * 32);
-	pthread_create(&tid, &attr, fpga_loop, NULL);
-	pthread_attr_destroy(&attr);
-superloop:
-	while (put != get) {
-		if (put > get) r = put - get;
-		else r = BUFSIZE - get;
+static struct {
+	char *dir[STRIPE_MAX];
+	int n, qd;
+	uint64_t block;
+	_Atomic uint64_t pending[STRIPE_MAX]; /* First FIFO position not on disk */
+	struct sink *sink;
+} stripe = { .qd = URING_QD, .block = URING_CHUNK };
 
-		if (r > MAX_WRITE) r = MAX_WRITE;
+static int stripe_manifest(uint64_t len) {
+	char path[PATH_MAX];
+	FILE *f;
+	int i, j;
 
-		pthread_mutex_unlock(&buflock);
-		r = write(1, &buf[get], r);
+	for (i = 0; i < stripe.n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", stripe.dir[i], STRIPE_MANIFEST);
+		f = fopen(path, "w");
+		if (f == NULL) {
+			perror(path);
+			return -1;
+		}
+		fprintf(f, "tsmini2-stripe 1\nblock %llu\nstripes %d\n",
+		  (unsigned long long)stripe.block, stripe.n);
+		if (len != UINT64_MAX)
+			fprintf(f, "length %llu\n", (unsigned long long)len);
+		for (j = 0; j < stripe.n; j++)
+			fprintf(f, "stripe %s/tsmini2-stripe%d.raw\n", stripe.dir[j], j);
+		if (fclose(f) != 0) {
+			perror(path);
+			return -1;
+		}
+	}
+	return 0;
+}
 
-		if (r == 0 || (r==-1 && (errno==EAGAIN||errno==EWOULDBLOCK))) {
-			/* This shouldn't happen unless stdout is O_NONBLOCK */
-			FD_SET(1, &wfds);
-			select(2, NULL, &wfds, &wfds, NULL);
-			pthread_mutex_lock(&buflock);
-			continue;
+static void stripe_release(void) {
+	uint64_t min = UINT64_MAX, p;
+	int i;
+
+	for (i = 0; i < stripe.n; i++) {
+		p = atomic_load_explicit(&stripe.pending[i], memory_order_acquire);
+		if (p < min) min = p;
+	}
+	sink_release(stripe.sink, min);
+}
+
+static void *stripe_loop(void *x) {
+	int i = (intptr_t)x, flags;
+	struct filesink fs;
+	struct dio *io;
+	uint64_t put, k = i, released = 0, n;
+	char path[PATH_MAX];
+	ssize_t r;
+
+	memset(&fs, 0, sizeof(fs));
+	fs.qd = stripe.qd;
+	fs.direct = 1;
+	snprintf(path, sizeof(path), "%s/tsmini2-stripe%d.raw", stripe.dir[i], i);
+	fs.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0644);
+	if (fs.fd == -1 && errno == EINVAL) {
+		fs.direct = 0;
+		fs.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	}
+	if (fs.fd == -1 || uring_init(&fs.u, fs.qd) != 0 ||
+	  syscall(__NR_io_uring_register, fs.u.fd, IORING_REGISTER_FILES,
+	  &fs.fd, 1) != 0) {
+		perror(path);
+		return (void *)2;
+	}
+	fs_register(&fs);
+
+	for (;;) {
+		put = atomic_load_explicit(&fifo.put, memory_order_acquire);
+		while (fs.tail - fs.head < fs.qd && (k + 1) * stripe.block <= put) {
+			io = &fs.io[fs.tail++ % fs.qd];
+			io->pos = k * stripe.block;
+			io->off = k / stripe.n * stripe.block;
+			io->len = stripe.block;
+			io->done = 0;
+			fs_submit(&fs, io);
+			k += stripe.n;
+		}
+
+		if (fs.tail != fs.head || fs.u.pending) {
+			if (uring_enter(&fs.u, fs.tail != fs.head) == -1 ||
+			  fs_reap(&fs, &released) != 0) {
+				perror(path);
+				return (void *)2;
+			}
+			n = fs.tail != fs.head ? fs.io[fs.head % fs.qd].pos :
+			  k * stripe.block;
+			atomic_store_explicit(&stripe.pending[i], n, memory_order_release);
+			stripe_release();
+		} else if (fifo.done) {
+			/* More may have come in before it stopped */
+			put = atomic_load_explicit(&fifo.put, memory_order_acquire);
+			if ((k + 1) * stripe.block <= put) continue;
+			break;
+		} else fifo_wait(&fifo, put);
+	}
+
+	/* The stream may end in a partial block of ours, never past it */
+	if (put > (k + 1) * stripe.block) put = (k + 1) * stripe.block;
+	if (put > k * stripe.block) {
+		flags = fcntl(fs.fd, F_GETFL);
+		fcntl(fs.fd, F_SETFL, flags & ~O_DIRECT);
+		for (n = k * stripe.block; n < put; n += r) {
+			r = pwrite(fs.fd, &fifo.buf[n % fifo.size], put - n,
+			  k / stripe.n * stripe.block + n - k * stripe.block);
+			if (r == -1 && errno == EINTR) r = 0;
+			else if (r == -1) {
+				perror(path);
+				return (void *)2;
+			}
+		}
+	}
+	atomic_store(&stripe.pending[i], UINT64_MAX);
+	if (close(fs.fd) != 0) {
+		perror(path);
+		return (void *)2;
+	}
+	return NULL;
+}
+
+static int stripe_run(struct sink *s) {
+	pthread_t tid[STRIPE_MAX];
+	void *ret;
+	int i, r = 0;
+
+	stripe.sink = s;
+	if (stripe_manifest(UINT64_MAX) != 0) return 2;
+	for (i = 0; i < stripe.n; i++)
+		pthread_create(&tid[i], NULL, stripe_loop, (void *)(intptr_t)i);
+	for (i = 0; i < stripe.n; i++) {
+		pthread_join(tid[i], &ret);
+		if (ret) r = (intptr_t)ret;
+	}
+	if (r) return r;
+	if (stripe_manifest(atomic_load(&fifo.put)) != 0) return 2;
+	return fifo.done - 1;
+}
+
+/* --listen: built-in TCP server replacing "nc -l PORT -e ./tsmini2".  One
+ * client at a time is served; while nobody is connected the backlog stays in
+ * the FIFO and the next client picks up where the last one stopped (less
+ * whatever the previous client had received but not read).  Sends
+ * are MSG_ZEROCOPY from the FIFO where the kernel supports it, and FIFO
+ * space is only released when the kernel reports a send complete.
+ */
+#define ZC_SENDS 1024 /* Zerocopy sends in flight */
+#define SNDBUF (4 * MAX_WRITE)
+
+/* --framed: instead of the bare stream, both ways carry struct frame, big
+ * endian.  The client opens with an ACK naming the sample it wants next,
+ * and tsmini2 answers with START giving the sample it actually resumes at
+ * (later if that data is gone), then DATA frames and finally END.  GAP
+ * frames mark samples lost to a full FIFO: .len samples from .sample.  The
+ * client keeps sending ACKs: every sample before .sample is safely stored,
+ * and .len more bytes may be sent after it.  Nothing the client has not
+ * acknowledged leaves the FIFO, so a client that reconnects after a drop
+ * loses nothing as long as the FIFO held out.  Once acquisition has stopped
+ * though, a dropped client is not waited for.
+ */
+#define FRAME_MAGIC 0x54534d46 /* "TSMF" */
+enum { FRAME_START = 1, FRAME_DATA, FRAME_END, FRAME_ACK, FRAME_GAP };
+
+struct frame {
+	uint32_t magic, type;
+	uint64_t sample, len;
+};
+
+static int listen_port = -1, framed;
+
+struct client {
+	int fd, zc, blocked;
+	uint32_t zid, zdone;      /* Next zerocopy send id, oldest incomplete */
+	uint64_t zend[ZC_SENDS];  /* FIFO position past each zerocopy send */
+
+	/* --framed only */
+	int ready, end;           /* Resume point known, END frame queued */
+	uint64_t acked, limit;    /* FIFO positions: client has, may be sent */
+	uint32_t nframe, hoff;    /* Frames begun, header bytes of the last sent */
+	uint64_t left;            /* Payload bytes of the last frame to go */
+	uint32_t nin;
+	struct frame in;          /* Partial message from the client */
+	struct frame hdr[ZC_SENDS]; /* Kept until their zerocopy send is done */
+};
+
+static int listen_open(int port) {
+	struct sockaddr_in6 a6;
+	struct sockaddr_in a4;
+	int fd, one = 1, zero = 0;
+
+	fd = socket(AF_INET6, SOCK_STREAM|SOCK_NONBLOCK, 0);
+	if (fd != -1) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+		memset(&a6, 0, sizeof(a6));
+		a6.sin6_family = AF_INET6;
+		a6.sin6_port = htons(port);
+		a6.sin6_addr = in6addr_any;
+		if (bind(fd, (struct sockaddr *)&a6, sizeof(a6)) == 0) goto bound;
+		close(fd);
+	}
+	fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+	if (fd == -1) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&a4, 0, sizeof(a4));
+	a4.sin_family = AF_INET;
+	a4.sin_port = htons(port);
+	a4.sin_addr.s_addr = INADDR_ANY;
+	if (bind(fd, (struct sockaddr *)&a4, sizeof(a4)) != 0) {
+		close(fd);
+		return -1;
+	}
+bound:
+	if (listen(fd, 4) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void client_setup(struct client *c) {
+	int one = 1, sz = SNDBUF;
+
+	if (setsockopt(c->fd, SOL_SOCKET, SO_SNDBUFFORCE, &sz, sizeof(sz)) != 0)
+		setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+	/* Blocks go out whole with MSG_MORE, no Nagle delay on the last one */
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->zc = setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+	c->blocked = 0;
+	c->zid = c->zdone = 0;
+	c->ready = c->end = 0;
+	c->hoff = sizeof(struct frame);
+	c->left = 0;
+	c->nin = 0;
+}
+
+static struct frame *frame_begin(struct client *c, uint32_t type,
+  uint64_t sample, uint64_t len) {
+	struct frame *h = &c->hdr[++c->nframe % ZC_SENDS];
+
+	h->magic = htonl(FRAME_MAGIC);
+	h->type = htonl(type);
+	h->sample = htobe64(sample);
+	h->len = htobe64(len);
+	c->hoff = 0;
+	c->left = type == FRAME_DATA ? len : 0;
+	return h;
+}
+
+/* Take in the client's ACKs; returns -1 once it has gone away */
+static int frame_recv(struct client *c, uint64_t *sent, uint64_t put) {
+	uint64_t pos;
+	ssize_t r;
+
+	for (;;) {
+		r = recv(c->fd, (uint8_t *)&c->in + c->nin, sizeof(c->in) - c->nin,
+		  MSG_DONTWAIT);
+		if (r == -1 && errno == EINTR) continue;
+		if (r == -1 && errno == EAGAIN) return 0;
+		if (r <= 0) return -1;
+		c->nin += r;
+		if (c->nin < sizeof(c->in)) continue;
+		c->nin = 0;
+		if (ntohl(c->in.magic) != FRAME_MAGIC ||
+		  ntohl(c->in.type) != FRAME_ACK)
+			return -1;
+		pos = sample_pos(&fifo, be64toh(c->in.sample));
+		if (!c->ready) {
+			/* Resume where asked if we still have it */
+			if (pos < c->acked) pos = c->acked;
+			if (pos > put) pos = put;
+			*sent = c->acked = pos;
+			frame_begin(c, FRAME_START, pos_sample(&fifo, pos), 0);
+			c->ready = 1;
+		} else if (pos > c->acked && pos <= *sent) c->acked = pos;
+		c->limit = c->acked + be64toh(c->in.len);
+	}
+}
+
+/* Send frames while the client has credit; returns -1 on a dead connection */
+static int frame_send(struct client *c, struct sink *s, uint64_t *sent,
+  uint64_t put) {
+	struct frame *h;
+	struct gap g;
+	struct iovec iov[2];
+	struct msghdr msg;
+	uint64_t n;
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while (c->ready && !c->blocked && c->zid - c->zdone < ZC_SENDS) {
+		h = &c->hdr[c->nframe % ZC_SENDS];
+		if (c->hoff == sizeof(*h) && c->left == 0) {
+			n = (put < c->limit ? put : c->limit);
+			n = n > *sent ? n - *sent : 0;
+			if (n > MAX_WRITE) n = MAX_WRITE;
+			n = sink_clip(s, *sent, n);
+			if (sink_gap(s, *sent, &g)) {
+				gap_report(s, &g);
+				h = frame_begin(c, FRAME_GAP, g.pos / fifo.sample_bytes +
+				  g.total - g.lost, g.lost);
+			} else if (n) {
+				h = frame_begin(c, FRAME_DATA, pos_sample(&fifo, *sent), n);
+			} else if (fifo.done && *sent == put && !c->end) {
+				h = frame_begin(c, FRAME_END, pos_sample(&fifo, put), 0);
+				c->end = 1;
+			} else break;
+		}
+		iov[0].iov_base = (uint8_t *)h + c->hoff;
+		iov[0].iov_len = sizeof(*h) - c->hoff;
+		iov[1].iov_base = &fifo.buf[*sent % fifo.size];
+		iov[1].iov_len = c->left;
+		msg.msg_iovlen = c->left ? 2 : 1;
+		r = sendmsg(c->fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL|
+		  (c->zc ? MSG_ZEROCOPY : 0));
+		if (r == -1 && (errno == EAGAIN || errno == ENOBUFS)) {
+			c->blocked = 1;
+			return 0;
 		} else if (r == -1 && errno == EINTR) {
-			pthread_mutex_lock(&buflock);
 			continue;
-		} else if (r == -1) {
-			perror("stdout");
-			return 2;
-		} else pthread_mutex_lock(&buflock);
-		get += r;
-		if (get >= BUFSIZE) get -= BUFSIZE;
-		if (nf != UINT32_MAX) nf -= r;
-	} 
+		} else if (r == -1) return -1;
+		n = sizeof(*h) - c->hoff;
+		if ((uint64_t)r < n) n = r;
+		c->hoff += n;
+		*sent += r - n;
+		c->left -= r - n;
+		if (c->zc) c->zend[c->zid++ % ZC_SENDS] = *sent;
+	}
+	return 0;
+}
 
-	if (nf == UINT32_MAX) return 1;
-	else pthread_cond_wait(&bufcond, &buflock);
+/* Collect zerocopy completions, returns the FIFO position now reusable */
+static uint64_t client_reap(struct client *c, uint64_t released) {
+	char ctl[CMSG_SPACE(sizeof(struct sock_extended_err)) * 16];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *ee;
 
-	goto superloop;
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = ctl;
+		msg.msg_controllen = sizeof(ctl);
+		if (recvmsg(c->fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) == -1) break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			/* TCP completes in order; ee_data is the newest id done */
+			if ((int32_t)(ee->ee_data + 1 - c->zdone) > 0) {
+				c->zdone = ee->ee_data + 1;
+				released = c->zend[ee->ee_data % ZC_SENDS];
+				c->blocked = 0;
+			}
+		}
+	}
+	return released;
+}
+
+static void client_drop(struct client *c, int efd) {
+	struct linger lg = { 1, 0 };
+
+	/* Abort so the kernel lets go of our FIFO pages right away */
+	setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+}
+
+static int listen_run(struct sink *s) {
+	static struct client cl;
+	struct client *c = &cl;
+	struct epoll_event ev, evs[4];
+	uint64_t put, sent = 0, released = 0, n;
+	uint8_t *b;
+	ssize_t r;
+	int lfd, efd, i, nev, fd, zc;
+
+	lfd = listen_open(listen_port);
+	if (lfd == -1) {
+		perror("listen");
+		return 2;
+	}
+	fifo.evfd = eventfd(0, EFD_NONBLOCK);
+	efd = epoll_create1(0);
+	ev.events = EPOLLIN;
+	ev.data.fd = lfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.fd = fifo.evfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, fifo.evfd, &ev);
+	c->fd = -1;
+
+	for (;;) {
+		put = atomic_load_explicit(&fifo.put, memory_order_acquire);
+
+		/* Framed clients can only skip between frames, and have to
+		 * give up whatever they did not acknowledge yet too.
+		 */
+		if (!framed) sent = sink_skip(s, sent);
+		else if (c->fd == -1 || (c->left == 0 &&
+		  c->hoff == sizeof(struct frame))) {
+			sent = sink_skip(s, sent);
+			n = atomic_load(&s->skip_to);
+			if (c->acked < n) c->acked = n;
+		}
+		if (framed && c->fd != -1 && frame_send(c, s, &sent, put) != 0) {
+			client_drop(c, efd);
+			released = sent;
+		} else if (framed && c->fd != -1 && c->blocked) {
+			ev.events = EPOLLOUT|EPOLLERR|EPOLLHUP|EPOLLIN;
+			ev.data.fd = c->fd;
+			epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+		}
+		while (!framed && c->fd != -1 && !c->blocked && put > sent &&
+		  c->zid - c->zdone < ZC_SENDS) {
+			n = put - sent;
+			if (n > MAX_WRITE) n = MAX_WRITE;
+			if ((b = sink_read(s, &sent, &n)) == NULL) {
+				released = sent;
+				break;
+			}
+			/* Only FIFO pages stay put until the send completes */
+			zc = c->zc && b != s->bounce;
+			r = send(c->fd, b, n, MSG_DONTWAIT|
+			  MSG_NOSIGNAL|(n < put - sent ? MSG_MORE : 0)|
+			  (zc ? MSG_ZEROCOPY : 0));
+			if (r == -1 && (errno == EAGAIN || errno == ENOBUFS)) {
+				/* Wait for EPOLLOUT, or a completion freeing optmem */
+				c->blocked = 1;
+				ev.events = EPOLLOUT|EPOLLERR|EPOLLHUP;
+				ev.data.fd = c->fd;
+				epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+			} else if (r == -1 && errno == EINTR) {
+				continue;
+			} else if (r == -1) {
+				client_drop(c, efd);
+				released = sent;
+			} else {
+				sent += r;
+				if (zc) c->zend[c->zid++ % ZC_SENDS] = sent;
+				else if (c->zid == c->zdone) released = sent;
+			}
+		}
+		if (c->fd == -1 || !c->zc) released = sent;
+		/* Framed clients hold the FIFO until they acknowledge */
+		sink_release(s, framed && released > c->acked ? c->acked : released);
+
+		if (fifo.done && (c->fd == -1 || (sent == put &&
+		  c->zid == c->zdone && (!framed || c->acked == put)))) break;
+		if (!framed && c->fd != -1 && !c->blocked && put > sent &&
+		  c->zid - c->zdone < ZC_SENDS) continue;
+		if (!c->blocked && fifo_arm(&fifo, put) && put == sent &&
+		  !fifo.done) continue;
+
+		nev = epoll_wait(efd, evs, 4, fifo.done ? 10 : -1);
+		for (i = 0; i < nev; i++) {
+			fd = evs[i].data.fd;
+			if (fd == lfd) {
+				fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+				if (fd == -1) continue;
+				if (c->fd != -1) {
+					close(fd); /* Busy, one client at a time */
+					continue;
+				}
+				c->fd = fd;
+				client_setup(c);
+				if (s->lossy) c->zc = 0; /* The bounce buffer is reused */
+				ev.events = EPOLLERR|EPOLLHUP|(framed ? EPOLLIN : 0);
+				ev.data.fd = fd;
+				epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+			} else if (fd == fifo.evfd) {
+				eventfd_read(fifo.evfd, &put);
+			} else if (fd == c->fd) {
+				if (c->zc) released = client_reap(c, released);
+				if ((evs[i].events & EPOLLHUP) || (framed &&
+				  (evs[i].events & EPOLLIN) && frame_recv(c, &sent, put))) {
+					client_drop(c, efd);
+					continue;
+				}
+				if (evs[i].events & EPOLLOUT) c->blocked = 0;
+				if (!c->blocked) {
+					ev.events = EPOLLERR|EPOLLHUP|(framed ? EPOLLIN : 0);
+					ev.data.fd = fd;
+					epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
+				}
+			}
+		}
+	}
+
+	if (c->fd != -1) close(c->fd);
+	close(lfd);
+	return fifo.done - 1;
+}
+
+/* --multicast: the stream cut into datagrams for any number of
+ * tsmini2-mcrecv subscribers.  Every datagram carries a packet sequence
+ * number for reordering and the index of its first sample for gap
+ * detection, big endian.  MC_PAYLOAD keeps datagrams inside a 9000 byte
+ * jumbo frame.  Datagrams go out MC_BATCH at a time with sendmmsg(), each
+ * gathering its header and a payload straight from the FIFO.
+ */
+#define MC_MAGIC 0x54534d32 /* "TSM2" */
+#define MC_END 1            /* Flag: the stream ends here */
+#define MC_PAYLOAD 8192
+#define MC_BATCH 64
+
+struct mc_hdr {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t len;    /* Payload bytes */
+	uint64_t seq;    /* Datagram number */
+	uint64_t sample; /* Index of the first sample in the payload */
+};
+
+static struct sockaddr_in mc_addr;
+static struct in_addr mc_if = { INADDR_ANY };
+
+static int mc_parse(char *arg) {
+	char *port = strrchr(arg, ':');
+
+	if (port == NULL) return -1;
+	*port++ = '\0';
+	mc_addr.sin_family = AF_INET;
+	mc_addr.sin_port = htons(strtoul(port, NULL, 0));
+	if (inet_pton(AF_INET, arg, &mc_addr.sin_addr) != 1 ||
+	  !IN_MULTICAST(ntohl(mc_addr.sin_addr.s_addr)))
+		return -1;
+	return 0;
+}
+
+static int mc_run(struct sink *s) {
+	static struct mc_hdr hdr[MC_BATCH];
+	static struct mmsghdr msg[MC_BATCH];
+	static struct iovec iov[MC_BATCH][2];
+	uint64_t put = 0, sent = 0, seq = 0, n, len, r, base;
+	int fd, sz = SNDBUF, one = 1, i, k, m;
+	uint8_t *b;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		perror("multicast");
+		return 2;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &sz, sizeof(sz)) != 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one));
+	if (mc_if.s_addr != INADDR_ANY &&
+	  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mc_if, sizeof(mc_if))) {
+		perror("--multicast-if");
+		return 2;
+	}
+	for (i = 0; i < MC_BATCH; i++) {
+		iov[i][0].iov_base = &hdr[i];
+		iov[i][0].iov_len = sizeof(hdr[i]);
+		msg[i].msg_hdr.msg_name = &mc_addr;
+		msg[i].msg_hdr.msg_namelen = sizeof(mc_addr);
+		msg[i].msg_hdr.msg_iov = iov[i];
+		msg[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	for (;;) {
+		r = fifo_wait(&fifo, put);
+		put += r;
+		if ((n = sink_skip(s, sent)) != sent) {
+			sent = n;
+			if (put < sent) put = sent;
+			sink_release(s, sent);
+		}
+		/* Full datagrams only, until the producer has stopped */
+		while (put - sent >= MC_PAYLOAD || (r == 0 && put > sent)) {
+			n = put - sent;
+			if (n > MC_BATCH * MC_PAYLOAD) n = MC_BATCH * MC_PAYLOAD;
+			if (r) n -= n % MC_PAYLOAD;
+			/* The sample index of a datagram must hold for all of it */
+			n = sink_clip(s, sent, n);
+			base = pos_sample(&fifo, sent) - sent / fifo.sample_bytes;
+			if ((b = sink_read(s, &sent, &n)) == NULL) {
+				put = sent;
+				continue;
+			}
+			for (i = 0; n; i++) {
+				len = n < MC_PAYLOAD ? n : MC_PAYLOAD;
+				hdr[i].magic = htonl(MC_MAGIC);
+				hdr[i].flags = 0;
+				hdr[i].len = htons(len);
+				hdr[i].seq = htobe64(seq + i);
+				hdr[i].sample = htobe64(base + (sent + i * MC_PAYLOAD) /
+				  fifo.sample_bytes);
+				iov[i][1].iov_base = b + i * MC_PAYLOAD;
+				iov[i][1].iov_len = len;
+				n -= len;
+			}
+			for (k = 0; k < i; k += m) {
+				m = sendmmsg(fd, msg + k, i - k, 0);
+				if (m == -1 && errno == EINTR) m = 0;
+				else if (m == -1) {
+					perror("multicast");
+					return 2;
+				}
+			}
+			for (k = 0; k < i; k++) sent += iov[k][1].iov_len;
+			seq += i;
+			sink_release(s, sent);
+		}
+		if (r == 0) break;
+	}
+
+	/* A few times over, the end must not go missing */
+	hdr[0].magic = htonl(MC_MAGIC);
+	hdr[0].flags = htons(MC_END);
+	hdr[0].len = 0;
+	hdr[0].seq = htobe64(seq);
+	hdr[0].sample = htobe64(pos_sample(&fifo, sent));
+	for (i = 0; i < 3; i++)
+		sendto(fd, &hdr[0], sizeof(hdr[0]), 0, (struct sockaddr *)&mc_addr,
+		  sizeof(mc_addr));
+	close(fd);
+	return fifo.done - 1;
+}
+
+#define SPILL_SIZE (16ULL << 30)
+
+/* Set up the scratch file and the sinks that read back from it */
+static int spill_open(int zerocopy) {
+	struct sink *sk;
+	struct stat st;
+	pthread_t tid;
+	int i, n = 0;
+
+	spill.rfd = open(spill.path, O_RDWR|O_CREAT, 0600);
+	if (spill.rfd == -1 || fstat(spill.rfd, &st) == -1) {
+		perror(spill.path);
+		return -1;
+	}
+	if (S_ISBLK(st.st_mode) && !spill.size &&
+	  ioctl(spill.rfd, BLKGETSIZE64, &spill.size) == -1) {
+		perror(spill.path);
+		return -1;
+	}
+	if (!spill.size) spill.size = SPILL_SIZE;
+	spill.size &= ~(uint64_t)(URING_CHUNK - 1);
+	if (S_ISREG(st.st_mode) && fallocate(spill.rfd, 0, 0, spill.size) != 0 &&
+	  (errno != EOPNOTSUPP || ftruncate(spill.rfd, spill.size) != 0)) {
+		perror(spill.path);
+		return -1;
+	}
+	if (spill.size < fifo.size) {
+		fprintf(stderr, "--spill: %s is smaller than the FIFO\n", spill.path);
+		return -1;
+	}
+	spill.hwm = fifo.size / 2;
 
+	/* Those that read through sink_read() and not straight from the FIFO */
+	for (i = 0; i < nsinks; i++) {
+		sk = &sinks[i];
+		if (sk->lossy || (sk->run == stdout_run && zerocopy) ||
+		  (sk->run == listen_run && framed) ||
+		  (sk->run != stdout_run && sk->run != listen_run &&
+		  sk->run != mc_run))
+			continue;
+		sk->spill = 1;
+		sk->bounce = malloc(MAX_WRITE);
+		n++;
+	}
+	if (!n) {
+		fprintf(stderr, "--spill: only stdout without --zerocopy, --listen "
+		  "without --framed and --multicast can read it back\n");
+		return -1;
+	}
+	pthread_create(&tid, NULL, spill_loop, NULL);
 	return 0;
 }
 
+int main(int argc, char **argv) {
+	ssize_t r;
+	uint32_t reg;
+	int c, regset = 0, info = 0, bench = 0;
+	/* -c, -o and -i are written once the backend is open, in their order */
+	struct { uint32_t reg, val; } regw[16];
+	pthread_attr_t attr;
+	pthread_t tid;
+	struct sigaction sa;
+	char *opt_save_arg = NULL;
+	char *opt_program_arg = NULL;
+	int zerocopy = 0, to_stdout = 0, i;
+	char *lossy = NULL, *p;
+	struct sink *sk;
+	uint64_t fifo_size = BUFSIZE;
+	enum { OPT_BACKEND = 256, OPT_SIM_RATE, OPT_SIM_PATTERN, OPT_ZEROCOPY,
+	  OPT_FIFO_SIZE, OPT_STATS, OPT_LOW_LATENCY, OPT_OUTPUT, OPT_CAPTURE_DIR,
+	  OPT_SEGMENT_SIZE, OPT_SEGMENT_TIME, OPT_STRIPE, OPT_STRIPE_BLOCK,
+	  OPT_STRIPE_QD, OPT_LISTEN, OPT_STDOUT, OPT_LOSSY, OPT_SHM,
+	  OPT_MULTICAST, OPT_MULTICAST_IF, OPT_FRAMED,
+	  OPT_OVERFLOW, OPT_BLOCKS, OPT_SPILL, OPT_SPILL_SIZE, OPT_SHED,
+	  OPT_SHED_CHANNELS, OPT_SHED_DECIMATE, OPT_DMA_UNCACHED, OPT_BENCH_DMA,
+	  OPT_CHANNELS, OPT_MINMAX, OPT_CRC, OPT_PIN, OPT_NUMA, OPT_DEADLINE };
+	static struct option long_options[] = {
+	  { "program", 1, 0, 'p' },
+	  { "save", 1, 0, 's' },
+	  { "initdma", 1, 0, 'i' },
+	  { "initcn1", 1, 0, 'o' },
+	  { "config", 1, 0, 'c' },
+	  { "info", 0, 0, 'l' },
+	  { "backend", 1, 0, OPT_BACKEND },
+	  { "sim-rate", 1, 0, OPT_SIM_RATE },
+	  { "sim-pattern", 1, 0, OPT_SIM_PATTERN },
+	  { "zerocopy", 0, 0, OPT_ZEROCOPY },
+	  { "fifo-size", 1, 0, OPT_FIFO_SIZE },
+	  { "stats", 2, 0, OPT_STATS },
+	  { "low-latency", 2, 0, OPT_LOW_LATENCY },
+	  { "output", 1, 0, OPT_OUTPUT },
+	  { "capture-dir", 1, 0, OPT_CAPTURE_DIR },
+	  { "segment-size", 1, 0, OPT_SEGMENT_SIZE },
+	  { "segment-time", 1, 0, OPT_SEGMENT_TIME },
+	  { "stripe", 1, 0, OPT_STRIPE },
+	  { "stripe-block", 1, 0, OPT_STRIPE_BLOCK },
+	  { "stripe-qd", 1, 0, OPT_STRIPE_QD },
+	  { "listen", 1, 0, OPT_LISTEN },
+	  { "framed", 0, 0, OPT_FRAMED },
+	  { "overflow", 1, 0, OPT_OVERFLOW },
+	  { "blocks", 2, 0, OPT_BLOCKS },
+	  { "spill", 1, 0, OPT_SPILL },
+	  { "spill-size", 1, 0, OPT_SPILL_SIZE },
+	  { "shed", 2, 0, OPT_SHED },
+	  { "shed-channels", 1, 0, OPT_SHED_CHANNELS },
+	  { "shed-decimate", 1, 0, OPT_SHED_DECIMATE },
+	  { "dma-uncached", 0, 0, OPT_DMA_UNCACHED },
+	  { "bench-dma", 0, 0, OPT_BENCH_DMA },
+	  { "channels", 1, 0, OPT_CHANNELS },
+	  { "minmax", 0, 0, OPT_MINMAX },
+	  { "crc", 0, 0, OPT_CRC },
+	  { "pin", 1, 0, OPT_PIN },
+	  { "numa", 1, 0, OPT_NUMA },
+	  { "deadline", 2, 0, OPT_DEADLINE },
+	  { "stdout", 0, 0, OPT_STDOUT },
+	  { "lossy", 1, 0, OPT_LOSSY },
+	  { "shm", 1, 0, OPT_SHM },
+	  { "multicast", 1, 0, OPT_MULTICAST },
+	  { "multicast-if", 1, 0, OPT_MULTICAST_IF },
+	  { "help", 0, 0, 'h' },
+	  { 0, 0, 0, 0}
+	};
+
+	dev = &pci_backend;
+
+	while ((c = getopt_long(argc, argv, "c:o:i:s:p:lh", long_options, NULL)) != -1) {
+		switch(c) {
+		case 'c':
+		case 'o':
+		case 'i':
+			if (regset == 16) {
+				fprintf(stderr, "Too many register writes\n");
+				return 3;
+			}
+			regw[regset].reg = c == 'c' ? REG_CFG :
+			  c == 'o' ? REG_CN1 : REG_DMABASE;
+			regw[regset++].val = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opt_save_arg = strdup(optarg);
+			break;
+		case 'p':
+			opt_program_arg = strdup(optarg);
+			break;
+		case 'l':
+			info = 1;
+			break;
+		case OPT_BACKEND:
+			if (strcmp(optarg, "pci") == 0) dev = &pci_backend;
+			else if (strcmp(optarg, "sim") == 0) dev = &sim_backend;
+			else {
+				fprintf(stderr, "Unknown backend \"%s\"\n", optarg);
+				return 3;
+			}
+			break;
+		case OPT_SIM_RATE:
+			sim_mult = strtoul(optarg, NULL, 0);
+			if (sim_mult == 0) sim_mult = 1;
+			break;
+		case OPT_SIM_PATTERN:
+			if (sim_parse_pattern(optarg) != 0) {
+				fprintf(stderr, "Bad --sim-pattern \"%s\"\n", optarg);
+				return 3;
+			}
+			break;
+		case OPT_ZEROCOPY:
+			zerocopy = 1;
+			break;
+		case OPT_FIFO_SIZE:
+			fifo_size = parse_size(optarg);
+			if (fifo_size == 0) {
+				fprintf(stderr, "--fifo-size: bad size %s\n", optarg);
+				return 3;
+			}
+			break;
+		case OPT_LOW_LATENCY:
+			ll_mode = 1;
+			if (optarg) ll_cpu = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_OUTPUT:
+			out_path = strdup(optarg);
+			break;
+		case OPT_CAPTURE_DIR:
+			seg.dir = strdup(optarg);
+			break;
+		case OPT_SEGMENT_SIZE:
+			seg.size = parse_size(optarg);
+			if (seg.size == 0 || seg.size % DIO_ALIGN) {
+				fprintf(stderr, "--segment-size must be a multiple "
+				  "of 4KB\n");
+				return 3;
+			}
+			break;
+		case OPT_SEGMENT_TIME:
+			seg.ns = strtoull(optarg, NULL, 0) * 1000000000ULL;
+			break;
+		case OPT_STRIPE:
+			for (p = strtok(strdup(optarg), ","); p; p = strtok(NULL, ",")) {
+				if (stripe.n == STRIPE_MAX) {
+					fprintf(stderr, "At most %d stripes\n", STRIPE_MAX);
+					return 3;
+				}
+				stripe.dir[stripe.n++] = p;
+			}
+			break;
+		case OPT_STRIPE_BLOCK:
+			stripe.block = parse_size(optarg);
+			if (stripe.block == 0 || stripe.block % DIO_ALIGN) {
+				fprintf(stderr, "--stripe-block must be a multiple "
+				  "of 4KB\n");
+				return 3;
+			}
+			break;
+		case OPT_LISTEN:
+			listen_port = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_FRAMED:
+			framed = 1;
+			break;
+		case OPT_BLOCKS:
+			blk_bytes = (optarg ? strtoul(optarg, NULL, 0) : 8192) *
+			  SAMPLE_BYTES;
+			if (blk_bytes == 0 || blk_bytes > MAX_WRITE) {
+				fprintf(stderr, "--blocks: 1 to %d samples per block\n",
+				  MAX_WRITE / SAMPLE_BYTES);
+				return 3;
+			}
+			break;
+		case OPT_SPILL:
+			spill.path = optarg;
+			break;
+		case OPT_SPILL_SIZE:
+			spill.size = parse_size(optarg);
+			if (spill.size == 0) {
+				fprintf(stderr, "--spill-size: bad size %s\n", optarg);
+				return 3;
+			}
+			break;
+		case OPT_CHANNELS:
+			xf.keep = 0;
+			for (p = strtok(optarg, ","); p; p = strtok(NULL, ",")) {
+				i = strtoul(p, NULL, 0);
+				if (i < 1 || i > 4) {
+					fprintf(stderr, "--channels: channels are 1 to 4\n");
+					return 3;
+				}
+				xf.keep |= 1 << (i - 1);
+			}
+			if (__builtin_popcount(xf.keep) == 3 || xf.keep == 0) {
+				fprintf(stderr, "--channels: 1, 2 or 4 of them, to keep "
+				  "samples a power of two\n");
+				return 3;
+			}
+			break;
+		case OPT_MINMAX:
+			xf.minmax = 1;
+			break;
+		case OPT_CRC:
+			xf.crc = 1;
+			break;
+		case OPT_PIN:
+			if (pin_add(optarg) != 0) {
+				fprintf(stderr, "--pin wants NAME:CPUS, once per thread\n");
+				return 3;
+			}
+			break;
+		case OPT_NUMA:
+			numa_node = strtol(optarg, NULL, 0);
+			if (numa_node < -1) {
+				fprintf(stderr, "--numa wants a node, or -1 for none\n");
+				return 3;
+			}
+			break;
+		case OPT_DEADLINE:
+			dl_pct = optarg ? strtoul(optarg, NULL, 0) : 10;
+			if (dl_pct < 1 || dl_pct > 90) {
+				fprintf(stderr, "--deadline: PCT must be 1..90\n");
+				return 3;
+			}
+			break;
+		case OPT_DMA_UNCACHED:
+			dma_uncached = 1;
+			break;
+		case OPT_BENCH_DMA:
+			bench = 1;
+			break;
+		case OPT_SHED:
+			shed.secs = optarg ? strtod(optarg, NULL) : 10;
+			if (shed.secs <= 0) {
+				fprintf(stderr, "--shed: SECS must be positive\n");
+				return 3;
+			}
+			break;
+		case OPT_SHED_CHANNELS:
+			shed.keep = 0;
+			for (p = strtok(optarg, ","); p; p = strtok(NULL, ",")) {
+				i = strtoul(p, NULL, 0);
+				if (i < 1 || i > 4) {
+					fprintf(stderr, "--shed-channels: channels are 1 to 4\n");
+					return 3;
+				}
+				shed.keep |= 1 << (i - 1);
+			}
+			if (shed.keep == 0) shed.keep = 0xf;
+			break;
+		case OPT_SHED_DECIMATE:
+			shed.decim = strtoul(optarg, NULL, 0);
+			if (shed.decim < 1 || shed.decim > 255) {
+				fprintf(stderr, "--shed-decimate: 1 to 255\n");
+				return 3;
+			}
+			break;
+		case OPT_OVERFLOW:
+			if (strcmp(optarg, "terminate") == 0) ovf_policy = OVF_TERMINATE;
+			else if (strcmp(optarg, "drop-newest") == 0)
+				ovf_policy = OVF_DROP_NEWEST;
+			else if (strcmp(optarg, "drop-oldest") == 0)
+				ovf_policy = OVF_DROP_OLDEST;
+			else {
+				fprintf(stderr, "--overflow: unknown policy %s\n", optarg);
+				return 3;
+			}
+			break;
+		case OPT_STDOUT:
+			to_stdout = 1;
+			break;
+		case OPT_LOSSY:
+			lossy = optarg;
+			break;
+		case OPT_SHM:
+			shm_name = optarg;
+			break;
+		case OPT_MULTICAST:
+			if (mc_parse(optarg) != 0) {
+				fprintf(stderr, "--multicast wants GROUP:PORT\n");
+				return 3;
+			}
+			break;
+		case OPT_MULTICAST_IF:
+			if (inet_pton(AF_INET, optarg, &mc_if) != 1) {
+				fprintf(stderr, "--multicast-if wants an IPv4 address\n");
+				return 3;
+			}
+			break;
+		case OPT_STRIPE_QD:
+			stripe.qd = strtoul(optarg, NULL, 0);
+			if (stripe.qd < 1 || stripe.qd > QD_MAX) {
+				fprintf(stderr, "--stripe-qd must be 1..%d\n", QD_MAX);
+				return 3;
+			}
+			break;
+		case OPT_STATS:
+			stats_secs = optarg ? strtoul(optarg, NULL, 0) : 0;
+			break;
+		case 'h':
+		default:
+			usage(argv);
+			return 0;
+		}
+	}
+
+	fifo.sample_bytes = 2 * __builtin_popcount(xf.keep);
+	blk_bytes = blk_bytes / SAMPLE_BYTES * fifo.sample_bytes;
+	xf_select();
+
+	r = dev->open_regs();
+	if (r) return r;
+
+	for (c = 0; c < regset; c++) reg_wr(regw[c].reg, regw[c].val);
+	blk_config = reg_rd(REG_CFG);
+
+	if (info) {
+		reg = reg_rd(REG_CFG);
+		printf("rev=%d\n", reg & 0xff);
+		printf("sel_an1_gnd=%d\n", !!(reg & (1 << 8)));
+		printf("sel_an2_gnd=%d\n", !!(reg & (1 << 9)));
+		printf("sel_an3_gnd=%d\n", !!(reg & (1 << 10)));
+		printf("sel_an4_gnd=%d\n", !!(reg & (1 << 11)));
+		printf("sel_an4_gnd=%d\n", !!(reg & (1 << 11)));
+		printf("sel_an3_dc=%d\n", !!(reg & (1 << 12)));
+		printf("sel_an4_dc=%d\n", !!(reg & (1 << 13)));
+		return 0;
+	}
+
+	if (bench) return dma_bench();
+	if (opt_save_arg) return opt_save(opt_save_arg);
+	else if (opt_program_arg) return opt_program(opt_program_arg);
+	else if (regset) return 0;
+
+	if (seg.dir) {
+		if (out_path) {
+			fprintf(stderr, "--output and --capture-dir are exclusive\n");
+			return 3;
+		}
+		out_path = seg.dir;
+		if (seg.ns) {
+			seg.size = 0;
+			seg.samples = (seg.ns / 1000000000ULL) * SAMPLE_RATE *
+			  (dev == &sim_backend ? sim_mult : 1);
+			seg.alloc = seg.samples * fifo.sample_bytes;
+			seg.alloc = (seg.alloc + DIO_ALIGN - 1) & ~(DIO_ALIGN - 1);
+		} else if (!seg.size) seg.size = SEG_SIZE;
+	}
+
+	if (out_path) sink_add("output", file_run);
+	if (stripe.n) sink_add("stripe", stripe_run)->noskip = 1;
+	if (listen_port >= 0) sink_add("listen", listen_run);
+	if (shm_name) sink_add("shm", shm_run)->lossy = 1;
+	if (mc_addr.sin_family) sink_add("multicast", mc_run);
+	if (to_stdout || !nsinks) sink_add("stdout", stdout_run);
+	for (p = lossy ? strtok(lossy, ",") : NULL; p; p = strtok(NULL, ",")) {
+		sk = sink_find(p);
+		if (sk == NULL || sk->run == file_run || sk->run == stripe_run) {
+			fprintf(stderr, "--lossy: %s is not a stdout, listen or "
+			  "multicast sink in use\n", p);
+			return 3;
+		}
+		if (framed && sk->run == listen_run) {
+			fprintf(stderr, "--lossy: --framed never skips data\n");
+			return 3;
+		}
+		sk->lossy = 1;
+		sk->bounce = malloc(MAX_WRITE);
+	}
+	for (i = 0; i < nsinks; i++) nstrict += !sinks[i].lossy;
+	if (xf.keep != 0xf && (framed || mc_addr.sin_family)) {
+		fprintf(stderr, "--channels: tsmini2-fetch and tsmini2-mcrecv want "
+		  "all 4\n");
+		return 3;
+	}
+	if (shed.secs && (!blk_bytes || !sink_find("stdout"))) {
+		fprintf(stderr, "--shed: needs --blocks on stdout to say what it "
+		  "did\n");
+		return 3;
+	}
+
+	for (i = 0; dl_pct && i < npins; i++)
+		if (strcmp(pins[i].name, "producer") == 0) break;
+	if (dl_pct && (ll_mode || i < npins)) {
+		fprintf(stderr, "--deadline: the kernel keeps SCHED_DEADLINE off "
+		  "pinned CPUs, and it can not busy-poll\n");
+		return 3;
+	}
+	if (numa_node == NUMA_CARD)
+		numa_node = dev == &pci_backend ? card_node() : -1;
+	if (pin_resolve() != 0) return 3;
+
+	r = dev->open_dma();
+	if (r) return r;
+
+	if (fifo_size < 4 * ring.size || fifo_size % 4096) {
+		fprintf(stderr, "--fifo-size must be a multiple of 4KB and at least "
+		  "%uMB, 4 DMA rings\n", 4 * ring.size >> 20);
+		return 3;
+	}
+	if (fifo_alloc(&fifo, fifo_size) != 0) {
+		fprintf(stderr, "%s: Memory allocation failed\n", argv[0]);
+		return 3;
+	}
+
+	if (spill.path && spill_open(zerocopy && !blk_bytes) != 0) return 3;
+	if (!ll_mode) copy_select(dma_uncached);
+
+	/* Linux trick for improved realtime determinism: */
+	mlockall(MCL_CURRENT|MCL_FUTURE);
+
+	dmabuf_phys = reg_rd(REG_DMABASE);
+	last = reg_rd(REG_DMAPTR) - dmabuf_phys;
+	last &= ~3;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 1024 * 32);
+	pthread_create(&tid, &attr, fpga_loop, NULL);
+	pthread_attr_destroy(&attr);
+
+	sk = sink_find("stdout");
+	if (zerocopy && sk && !sk->lossy && !blk_bytes) zc_init();
+	if (zc_mode) sk->noskip = 1;
+	sa.sa_handler = stop_handler;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	/* One sink's reader going away must not take the others down */
+	if (nsinks > 1) signal(SIGPIPE, SIG_IGN);
+	if (stats_secs > 0) pthread_create(&tid, NULL, stats_loop, NULL);
+
+	for (i = 0; i < nsinks; i++)
+		pthread_create(&sinks[i].tid, NULL, sink_loop, &sinks[i]);
+	r = 0;
+	for (i = 0; i < nsinks; i++) {
+		pthread_join(sinks[i].tid, NULL);
+		if (sinks[i].status > r) r = sinks[i].status;
+	}
+
+	if (stats_secs >= 0) stats_report();
+	if (shm_name) shm_unlink(shm_name);
+	return r;
+}